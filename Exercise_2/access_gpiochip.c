@@ -0,0 +1,226 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <glob.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+/*
+ * GPIO toggling through the /dev/gpiochipN v2 line-request uAPI.
+ *
+ * One line request holds all selected lines and every update of all of them
+ * is a single GPIO_V2_LINE_SET_VALUES ioctl, instead of one ASCII write() per
+ * line to /sys/class/gpio/gpioN/value as in access_hardware.c.
+ *
+ * Usage:
+ *   access_gpiochip [-c chip] [-l off,off,...] [-m blink|max|sysfs] [-n toggles]
+ *
+ *   blink  toggle the lines once a second (default)
+ *   max    toggle as fast as possible and report toggles/s
+ *   sysfs  same as max, but through /sys/class/gpio/gpioN/value, where N is
+ *          the chip's base + offset (the lines must be exported first)
+ *
+ * Compare both paths on any Linux box with gpio-sim:
+ *   modprobe gpio-sim
+ *   mkdir -p /sys/kernel/config/gpio-sim/bench/bank0
+ *   echo 8 > /sys/kernel/config/gpio-sim/bench/bank0/num_lines
+ *   echo 1 > /sys/kernel/config/gpio-sim/bench/live
+ *   ./access_gpiochip -c /dev/gpiochipN -l 0,1,2,3 -m max
+ */
+
+#define DEFAULT_CHIP "/dev/gpiochip0"
+#define DEFAULT_TOGGLES 100000
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int parse_lines(char *arg, unsigned int *offsets){
+  int n = 0;
+
+  for(char *tok = strtok(arg, ","); tok != NULL && n < GPIO_V2_LINES_MAX;
+      tok = strtok(NULL, ",")){
+    offsets[n++] = strtoul(tok, NULL, 0);
+  }
+  return n;
+}
+
+/* Request all lines as outputs in one line request, returns the request fd */
+static int request_lines(const char *chip, unsigned int *offsets, int n){
+  struct gpio_v2_line_request req;
+
+  int fd = open(chip, O_RDWR | O_CLOEXEC);
+  if(fd < 0){
+    return -1;
+  }
+
+  memset(&req, 0, sizeof(req));
+  memcpy(req.offsets, offsets, n * sizeof(*offsets));
+  req.num_lines = n;
+  req.config.flags = GPIO_V2_LINE_FLAG_OUTPUT;
+  strcpy(req.consumer, "access_gpiochip");
+
+  int ret = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+  close(fd);
+  return ret < 0 ? -1 : req.fd;
+}
+
+static int read_sysfs(const char *path, char *buf, int len){
+  int fd = open(path, O_RDONLY);
+  if(fd < 0){
+    return -1;
+  }
+  int n = read(fd, buf, len - 1);
+  close(fd);
+  buf[n > 0 ? n : 0] = '\0';
+  buf[strcspn(buf, "\n")] = '\0';
+  return 0;
+}
+
+/* Legacy sysfs number of the chip's first line, matched by chip label */
+static int chip_base(const char *chip){
+  struct gpiochip_info info;
+  char path[300], buf[64];
+  glob_t g;
+  int base = -1;
+
+  int fd = open(chip, O_RDONLY | O_CLOEXEC);
+  if(fd < 0){
+    return -1;
+  }
+  int ret = ioctl(fd, GPIO_GET_CHIPINFO_IOCTL, &info);
+  close(fd);
+  if(ret < 0){
+    return -1;
+  }
+
+  if(glob("/sys/class/gpio/gpiochip*", 0, NULL, &g) != 0){
+    return -1;
+  }
+  for(size_t i = 0; i < g.gl_pathc && base < 0; i++){
+    snprintf(path, sizeof(path), "%s/label", g.gl_pathv[i]);
+    if(read_sysfs(path, buf, sizeof(buf)) == 0 && strcmp(buf, info.label) == 0){
+      snprintf(path, sizeof(path), "%s/base", g.gl_pathv[i]);
+      if(read_sysfs(path, buf, sizeof(buf)) == 0){
+        base = atoi(buf);
+      }
+    }
+  }
+  globfree(&g);
+  return base;
+}
+
+static int run_chardev(int lfd, int n, long toggles, int max){
+  struct gpio_v2_line_values vals = {
+    .mask = n == 64 ? ~0ULL : (1ULL << n) - 1,
+  };
+
+  double start = now();
+  for(long i = 0; i < toggles; i++){
+    vals.bits = (i & 1) ? 0 : vals.mask;
+    if(ioctl(lfd, GPIO_V2_LINE_SET_VALUES_IOCTL, &vals) < 0){
+      printf("Error: %s \n", strerror(errno));
+      return -1;
+    }
+    if(!max){
+      sleep(1);
+    }
+  }
+  double secs = now() - start;
+
+  printf("chardev: %ld toggles of %i lines in %.3f s: %.0f toggles/s, %.0f line edges/s\n",
+         toggles, n, secs, toggles / secs, toggles * n / secs);
+  return 0;
+}
+
+static int run_sysfs(const char *chip, unsigned int *offsets, int n, long toggles){
+  int fds[GPIO_V2_LINES_MAX];
+  char path[64];
+
+  int base = chip_base(chip);
+  if(base < 0){
+    printf("Can't find sysfs base of %s\n", chip);
+    return -1;
+  }
+
+  for(int i = 0; i < n; i++){
+    snprintf(path, sizeof(path), "/sys/class/gpio/gpio%u/value", base + offsets[i]);
+    fds[i] = open(path, O_WRONLY);
+    if(fds[i] < 0){
+      printf("Error opening %s: %s \n", path, strerror(errno));
+      return -1;
+    }
+  }
+
+  double start = now();
+  for(long i = 0; i < toggles; i++){
+    const char *val = (i & 1) ? "0" : "1";
+    for(int j = 0; j < n; j++){
+      write(fds[j], val, 1);
+    }
+  }
+  double secs = now() - start;
+
+  printf("sysfs:   %ld toggles of %i lines in %.3f s: %.0f toggles/s, %.0f line edges/s\n",
+         toggles, n, secs, toggles / secs, toggles * n / secs);
+
+  for(int i = 0; i < n; i++){
+    close(fds[i]);
+  }
+  return 0;
+}
+
+int main(int argc, char *argv[]){
+  const char *chip = DEFAULT_CHIP;
+  const char *mode = "blink";
+  unsigned int offsets[GPIO_V2_LINES_MAX] = { 26 };
+  int n = 1;
+  long toggles = -1;
+  int opt;
+
+  while((opt = getopt(argc, argv, "c:l:m:n:")) != -1){
+    switch(opt){
+      case 'c':
+        chip = optarg;
+        break;
+      case 'l':
+        n = parse_lines(optarg, offsets);
+        break;
+      case 'm':
+        mode = optarg;
+        break;
+      case 'n':
+        toggles = atol(optarg);
+        break;
+      default:
+        printf("Usage: %s [-c chip] [-l off,off,...] [-m blink|max|sysfs] [-n toggles]\n",
+               argv[0]);
+        return -1;
+    }
+  }
+
+  if(strcmp(mode, "sysfs") == 0){
+    return run_sysfs(chip, offsets, n, toggles < 0 ? DEFAULT_TOGGLES : toggles);
+  }
+
+  int lfd = request_lines(chip, offsets, n);
+  if(lfd < 0){
+    printf("Error: %s \n", strerror(errno));
+    return -1;
+  }
+
+  int max = strcmp(mode, "max") == 0;
+  if(toggles < 0){
+    toggles = max ? DEFAULT_TOGGLES : __LONG_MAX__;
+  }
+
+  int ret = run_chardev(lfd, n, toggles, max);
+  close(lfd);
+  return ret;
+}
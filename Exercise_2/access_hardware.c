@@ -16,6 +16,7 @@ int main(){
     write(fd, write_one, strlen(write_one));
     sleep(1);
     write(fd, write_zero, strlen(write_zero));
+    sleep(1);
   }
 
 }
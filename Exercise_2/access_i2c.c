@@ -5,21 +5,23 @@
 #include <string.h>
 #include <sys/ioctl.h>
 
+#include "i2c_bus.h"
+
 int main(){
-  int fd, ctlret;
-  char read_buffer[4];
+  struct i2c_bus bus;
+  unsigned char read_buffer[4];
 
-  fd = open("/dev/i2c-1", O_RDONLY);
-  ctlret = ioctl(fd, 0x0703, 0x42);
+  if(i2c_bus_open(&bus, "/dev/i2c-1") < 0){
+    printf("Error: %s \n", strerror(errno));
+    return -1;
+  }
 
   while(1){
-    if(ctlret == 0){
-        read(fd, read_buffer, 4);
-        printf("Read data: %i \n", read_buffer[0]);
+    if(i2c_bus_read(&bus, 0x42, -1, read_buffer, 4) == 0){
+        printf("Read data: %i \n", (signed char)read_buffer[0]);
         sleep(1);
     } else {
         printf("Error: %s \n", strerror(errno));
-        break;
         return -1;
     }
   }
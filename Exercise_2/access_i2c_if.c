@@ -1,31 +1,224 @@
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <time.h>
 #include <sys/ioctl.h>
+#include <sys/timerfd.h>
 
-int main(){
-  int fd, fd_led;
-  char read_buffer[4];
+#include "i2c_bus.h"
+
+/*
+ * Temperature alarm on the LED (GPIO 26).
+ *
+ * Sampling is driven by one timerfd on absolute CLOCK_MONOTONIC deadlines,
+ * so the schedule never drifts. All sensors due at the same deadline are
+ * read in a single batched I2C transfer, and the LED is only written when
+ * the alarm state changes. With one common period the timer is armed once
+ * and a wakeup costs read(timerfd) + one I2C ioctl.
+ *
+ * Each sensor has its own period and hysteresis: the alarm turns on at
+ * temp >= alarm_on and off again at temp <= alarm_off.
+ *
+ * Usage: access_i2c_if [-v] [config]
+ *
+ * Config, one sensor per line:
+ *   # addr  period_ms  alarm_on  alarm_off
+ *   0x48    1000       32        30
+ */
+
+#define MAX_SENSORS 16
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000LL
+
+struct sensor {
+  unsigned short addr;
+  int64_t period_ns;
+  int alarm_on;
+  int alarm_off;
+
+  int64_t deadline;   // next absolute sample time
+  int alarm;
+  unsigned char buf[2];
+};
+
+static struct sensor sensors[MAX_SENSORS] = {
+  { .addr = 0x48, .period_ns = 1000 * NSEC_PER_MSEC, .alarm_on = 32, .alarm_off = 30 },
+};
+static int sensors_len = 1;
+
+static int64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * NSEC_PER_SEC + ts.tv_nsec;
+}
+
+static int read_config(const char *path){
+  char line[128];
+  int n = 0;
+
+  FILE *f = fopen(path, "r");
+  if(f == NULL){
+    return -1;
+  }
+
+  while(fgets(line, sizeof(line), f) != NULL && n < MAX_SENSORS){
+    unsigned int addr;
+    long period_ms;
+    int on, off;
+
+    if(line[0] == '#' || sscanf(line, "%i %ld %i %i", &addr, &period_ms, &on, &off) != 4){
+      continue;
+    }
+    if(period_ms <= 0 || off > on){
+      printf("Ignoring sensor 0x%02x: bad period or hysteresis\n", addr);
+      continue;
+    }
+    sensors[n++] = (struct sensor){ .addr = addr, .period_ns = period_ms * NSEC_PER_MSEC,
+                                    .alarm_on = on, .alarm_off = off };
+  }
+  fclose(f);
+
+  if(n > 0){
+    sensors_len = n;
+  }
+  return n;
+}
+
+/* Period shared by all sensors, 0 if they differ */
+static int64_t common_period(void){
+  for(int i = 1; i < sensors_len; i++){
+    if(sensors[i].period_ns != sensors[0].period_ns){
+      return 0;
+    }
+  }
+  return sensors[0].period_ns;
+}
+
+static void arm_timer(int tfd, int64_t deadline, int64_t interval){
+  struct itimerspec its = {
+    .it_value = { deadline / NSEC_PER_SEC, deadline % NSEC_PER_SEC },
+    .it_interval = { interval / NSEC_PER_SEC, interval % NSEC_PER_SEC },
+  };
+  timerfd_settime(tfd, TFD_TIMER_ABSTIME, &its, NULL);
+}
+
+int main(int argc, char *argv[]){
+  struct i2c_bus bus;
+  struct i2c_xfer xfers[MAX_SENSORS];
+  struct sensor *due[MAX_SENSORS];
+  int fd_led, tfd;
+  int verbose = 0;
+  int led = -1;
   char write_one[] = "1";
   char write_zero[] = "0";
 
-  fd = open("/dev/i2c-1", O_RDONLY);
+  int arg = 1;
+  if(argc > arg && strcmp(argv[arg], "-v") == 0){
+    verbose = 1;
+    arg++;
+  }
+  if(argc > arg && read_config(argv[arg]) <= 0){
+    printf("No sensors in %s, using defaults\n", argv[arg]);
+  }
+
+  if(i2c_bus_open(&bus, "/dev/i2c-1") < 0){
+    printf("Error: %s \n", strerror(errno));
+    return -1;
+  }
   fd_led = open("/sys/class/gpio/gpio26/value", O_WRONLY);
-  ioctl(fd, 0x0703, 0x48);
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_CLOEXEC);
+
+  int64_t start = now_ns();
+  for(int i = 0; i < sensors_len; i++){
+    sensors[i].deadline = start;
+  }
+
+  /* With a common period the timer runs periodically and is never re-armed */
+  int64_t interval = common_period();
+  int64_t armed = start;
+  arm_timer(tfd, armed, interval);
 
   while(1){
-    read(fd, read_buffer, 4);
-    printf("Read data: %i\n", read_buffer[0]);
+    uint64_t expirations;
+    if(read(tfd, &expirations, sizeof(expirations)) != sizeof(expirations)){
+      continue;
+    }
+    if(interval){
+      armed += (expirations - 1) * interval;
+    }
+
+    /*
+     * Collect every sensor whose deadline has passed. The periodic timer
+     * counts missed ticks itself; a one-shot wakeup can be late by several
+     * periods, which only the clock tells.
+     */
+    int64_t now = interval ? armed : now_ns();
+    int n = 0;
+    for(int i = 0; i < sensors_len; i++){
+      struct sensor *s = &sensors[i];
+      if(s->deadline > now){
+        continue;
+      }
+      /* Skip whole periods after an overrun instead of bursting */
+      s->deadline += ((now - s->deadline) / s->period_ns + 1) * s->period_ns;
+
+      xfers[n] = (struct i2c_xfer){ .addr = s->addr, .reg = 0x00, .buf = s->buf, .len = 2 };
+      due[n++] = s;
+    }
+
+    if(n > 0 && i2c_bus_xfer(&bus, xfers, n) == 0){
+      int any_alarm = 0;
+
+      for(int i = 0; i < n; i++){
+        struct sensor *s = due[i];
+        int temp = (signed char)s->buf[0];
 
-    if(read_buffer[0] == 32){
-      write(fd_led, write_one, strlen(write_one));
-      fprintf(stdout, "Warning, temperature over 32\n");
+        if(verbose){
+          printf("Read data 0x%02x: %i\n", s->addr, temp);
+        }
+
+        if(!s->alarm && temp >= s->alarm_on){
+          s->alarm = 1;
+          fprintf(stdout, "Warning, temperature at 0x%02x over %i\n", s->addr, s->alarm_on);
+        } else if(s->alarm && temp <= s->alarm_off){
+          s->alarm = 0;
+          fprintf(stdout, "Temperature at 0x%02x back below %i\n", s->addr, s->alarm_off);
+        }
+      }
+      for(int i = 0; i < sensors_len; i++){
+        any_alarm |= sensors[i].alarm;
+      }
+
+      /* Only touch the LED on a state transition */
+      if(any_alarm != led){
+        led = any_alarm;
+        if(led){
+          write(fd_led, write_one, strlen(write_one));
+        } else {
+          write(fd_led, write_zero, strlen(write_zero));
+        }
+      }
+    } else if(n > 0){
+      printf("Error: %s \n", strerror(errno));
+    }
+
+    /* Next wakeup is the earliest deadline */
+    int64_t next = sensors[0].deadline;
+    for(int i = 1; i < sensors_len; i++){
+      if(sensors[i].deadline < next){
+        next = sensors[i].deadline;
+      }
+    }
+    if(interval && next == armed + interval){
+      armed = next;
     } else {
-      write(fd_led, write_zero, strlen(write_zero));
+      armed = next;
+      arm_timer(tfd, armed, interval);
     }
-    sleep(1);
   }
 
 }
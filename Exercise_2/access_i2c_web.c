@@ -1,30 +1,320 @@
+#define _GNU_SOURCE
 #include <errno.h>
 #include <stdio.h>
+#include <stdlib.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
 #include <sys/ioctl.h>
+#include <sys/epoll.h>
+#include <sys/timerfd.h>
+#include <sys/socket.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
 
-int main(){
-  int fd, fd_led, fd_web;
+/*
+ * Serves the temperature over HTTP from a single epoll loop.
+ *
+ *   GET /            -> HTML page
+ *   GET /temp.json   -> {"temperature":N}
+ *
+ * The sensor is sampled once a second by a timerfd in the same loop. Both
+ * responses (headers + body) are rendered into static buffers only when the
+ * reading changes, so a request costs one read() and one write() and never
+ * touches the filesystem. Connections are kept alive unless the client asks
+ * otherwise.
+ *
+ * Usage: access_i2c_web [port] [i2c-device]
+ */
 
+#define HTTP_PORT 8080
+#define MAX_EVENTS 64
+#define MAX_CONNS 1024
+#define REQ_LEN 2048
+#define RESP_LEN 512
+
+struct http_resp {
+  char buf[RESP_LEN];
+  int len;
+};
+
+struct http_conn {
+  int fd;
+  char req[REQ_LEN];
+  int req_len;
+  const char *out;
+  int out_len;
+  char pending[RESP_LEN]; /* private copy of a response the socket couldn't take */
+  int close_after;
+};
+
+static struct http_resp resp_html, resp_json;
+static struct http_resp resp_404 = { .len = -1 };
+static struct http_conn *conns[MAX_CONNS];
+
+static int temperature = -1000;
+
+static void render_resp(struct http_resp *r, const char *type, const char *body){
+  r->len = snprintf(r->buf, RESP_LEN,
+                    "HTTP/1.1 200 OK\r\n"
+                    "Content-Type: %s\r\n"
+                    "Content-Length: %zu\r\n"
+                    "Cache-Control: no-cache\r\n"
+                    "\r\n%s", type, strlen(body), body);
+}
+
+/* Only called when the reading actually changed */
+static void render_all(void){
+  char body[128];
+
+  snprintf(body, sizeof(body),
+           "<html><body><h1>Temperature: %i</h1></body></html>", temperature);
+  render_resp(&resp_html, "text/html", body);
+
+  snprintf(body, sizeof(body),
+           "{\"temperature\":%i}", temperature);
+  render_resp(&resp_json, "application/json", body);
+}
+
+static void sample_sensor(int fd){
   char read_buffer[4];
-  char write_one[] = "1";
-  char write_zero[] = "0";
-  char write_temp[64];
 
-  fd = open("/dev/i2c-1", O_RDONLY);
-  fd_led = open("/sys/class/gpio/gpio26/value", O_WRONLY);
-  fd_web = open("/www/pages/index.html", O_WRONLY);
+  if(read(fd, read_buffer, 4) < 1){
+    return;
+  }
+  if(read_buffer[0] != temperature){
+    temperature = read_buffer[0];
+    render_all();
+  }
+}
 
-  ioctl(fd, 0x0703, 0x48);
+static void conn_close(int epfd, struct http_conn *c){
+  epoll_ctl(epfd, EPOLL_CTL_DEL, c->fd, NULL);
+  close(c->fd);
+  conns[c->fd] = NULL;
+  free(c);
+}
 
+/* Returns 0 when everything is written, 1 if the socket is full, -1 on error */
+static int conn_flush(int epfd, struct http_conn *c){
+  while(c->out_len > 0){
+    ssize_t n = write(c->fd, c->out, c->out_len);
+    if(n < 0){
+      if(errno == EAGAIN){
+        /* The shared buffers may be re-rendered before we get to finish,
+           so keep our own copy of what is left */
+        if(c->out != c->pending){
+          memcpy(c->pending, c->out, c->out_len);
+          c->out = c->pending;
+        }
+        /* Not EPOLLIN: more requests can wait in the socket until this is out */
+        struct epoll_event ev = { .events = EPOLLOUT, .data.fd = c->fd };
+        epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+        return 1;
+      }
+      return -1;
+    }
+    c->out += n;
+    c->out_len -= n;
+  }
+  return 0;
+}
+
+static const struct http_resp *route(const char *req){
+  if(strncmp(req, "GET ", 4) != 0){
+    return &resp_404;
+  }
+  req += 4;
+  if(strncmp(req, "/ ", 2) == 0 || strncmp(req, "/index.html ", 12) == 0){
+    return &resp_html;
+  }
+  if(strncmp(req, "/temp.json ", 11) == 0){
+    return &resp_json;
+  }
+  return &resp_404;
+}
+
+static int wants_close(const char *req, const char *end){
+  const char *eol = memchr(req, '\r', end - req);
+
+  /* HTTP/1.0 defaults to close, HTTP/1.1 to keep-alive */
+  int http10 = eol != NULL && eol - req >= 8 && memcmp(eol - 8, "HTTP/1.0", 8) == 0;
+  if(memmem(req, end - req, "Connection: close", 17) != NULL){
+    return 1;
+  }
+  if(memmem(req, end - req, "Connection: keep-alive", 22) != NULL){
+    return 0;
+  }
+  return http10;
+}
+
+/*
+ * Answer every complete request in the buffer (pipelining). Stops early
+ * when the socket is full; the rest stays buffered until the flush is done.
+ * Returns -1 when the connection was closed.
+ */
+static int conn_answer(int epfd, struct http_conn *c){
+  char *start = c->req;
+  char *end;
+  while((end = strstr(start, "\r\n\r\n")) != NULL){
+    const struct http_resp *r = route(start);
+    c->close_after = wants_close(start, end);
+    start = end + 4;
+
+    if(r->len < 0){
+      static const char nf[] = "HTTP/1.1 404 Not Found\r\nContent-Length: 0\r\n\r\n";
+      c->out = nf;
+      c->out_len = sizeof(nf) - 1;
+    } else {
+      c->out = r->buf;
+      c->out_len = r->len;
+    }
+
+    int ret = conn_flush(epfd, c);
+    if(ret < 0 || (ret == 0 && c->close_after)){
+      conn_close(epfd, c);
+      return -1;
+    }
+    if(ret > 0){
+      break;
+    }
+  }
+
+  c->req_len -= start - c->req;
+  memmove(c->req, start, c->req_len + 1);
+  if(c->req_len >= REQ_LEN - 1){
+    conn_close(epfd, c);
+    return -1;
+  }
+  return 0;
+}
+
+static void conn_handle(int epfd, struct http_conn *c){
+  /* Finish a stalled response, then the requests queued behind it */
+  if(c->out_len > 0){
+    int ret = conn_flush(epfd, c);
+    if(ret < 0 || (ret == 0 && c->close_after)){
+      conn_close(epfd, c);
+      return;
+    }
+    if(ret > 0){
+      return;
+    }
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = c->fd };
+    epoll_ctl(epfd, EPOLL_CTL_MOD, c->fd, &ev);
+
+    if(conn_answer(epfd, c) < 0 || c->out_len > 0){
+      return;
+    }
+  }
+
+  ssize_t n = read(c->fd, c->req + c->req_len, REQ_LEN - 1 - c->req_len);
+  if(n <= 0){
+    if(n < 0 && errno == EAGAIN){
+      return;
+    }
+    conn_close(epfd, c);
+    return;
+  }
+  c->req_len += n;
+  c->req[c->req_len] = '\0';
+
+  conn_answer(epfd, c);
+}
+
+static void conn_accept(int epfd, int lfd){
+  while(1){
+    int fd = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+    if(fd < 0){
+      return;
+    }
+    if(fd >= MAX_CONNS){
+      close(fd);
+      continue;
+    }
+
+    int one = 1;
+    setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+
+    struct http_conn *c = calloc(1, sizeof(*c));
+    if(c == NULL){
+      close(fd);
+      continue;
+    }
+    c->fd = fd;
+    conns[fd] = c;
+
+    struct epoll_event ev = { .events = EPOLLIN, .data.fd = fd };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fd, &ev);
+  }
+}
+
+int main(int argc, char *argv[]){
+  int fd, lfd, tfd, epfd;
+  int port = argc > 1 ? atoi(argv[1]) : HTTP_PORT;
+  const char *i2c_dev = argc > 2 ? argv[2] : "/dev/i2c-1";
+
+  fd = open(i2c_dev, O_RDONLY);
+  if(fd < 0 || ioctl(fd, 0x0703, 0x48) < 0){
+    printf("Error: %s \n", strerror(errno));
+    return -1;
+  }
+
+  lfd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+  int one = 1;
+  setsockopt(lfd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+
+  struct sockaddr_in addr = {
+    .sin_family = AF_INET,
+    .sin_port = htons(port),
+    .sin_addr.s_addr = htonl(INADDR_ANY),
+  };
+  if(bind(lfd, (struct sockaddr *)&addr, sizeof(addr)) < 0 || listen(lfd, 128) < 0){
+    printf("Error: %s \n", strerror(errno));
+    return -1;
+  }
+
+  /* Sample once a second from the same loop */
+  tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+  struct itimerspec its = {
+    .it_interval = { .tv_sec = 1 },
+    .it_value = { .tv_sec = 1 },
+  };
+  timerfd_settime(tfd, 0, &its, NULL);
+
+  sample_sensor(fd);
+  render_all();
+
+  epfd = epoll_create1(EPOLL_CLOEXEC);
+  struct epoll_event ev = { .events = EPOLLIN };
+  ev.data.fd = lfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, lfd, &ev);
+  ev.data.fd = tfd;
+  epoll_ctl(epfd, EPOLL_CTL_ADD, tfd, &ev);
+
+  printf("Serving temperature on port %i\n", port);
+
+  struct epoll_event events[MAX_EVENTS];
   while(1){
-    read(fd, read_buffer, 4);
-    sprintf(write_temp, "<html><body><h1>Temperature: %i</h1></body></html>", read_buffer[0]);
-    lseek(fd_web, 0, SEEK_SET);
-    write(fd_web, write_temp, strlen(write_temp));
-    sleep(1);
+    int n = epoll_wait(epfd, events, MAX_EVENTS, -1);
+
+    for(int i = 0; i < n; i++){
+      int efd = events[i].data.fd;
+
+      if(efd == lfd){
+        conn_accept(epfd, lfd);
+      } else if(efd == tfd){
+        unsigned long long expirations;
+        read(tfd, &expirations, sizeof(expirations));
+        sample_sensor(fd);
+      } else if(conns[efd] != NULL){
+        if(events[i].events & (EPOLLHUP | EPOLLERR)){
+          conn_close(epfd, conns[efd]);
+        } else {
+          conn_handle(epfd, conns[efd]);
+        }
+      }
+    }
   }
 
 }
@@ -0,0 +1,138 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "i2c_bus.h"
+
+/*
+ * Compares the old access path (I2C_SLAVE + pointer write() + read() per
+ * device) with batched i2c_bus_xfer() reads.
+ *
+ * Test without hardware against i2c-stub:
+ *   modprobe i2c-dev
+ *   modprobe i2c-stub chip_addr=0x42,0x48
+ *   ./i2c_bench /dev/i2c-N 0x42 0x48
+ *
+ * i2c-stub is SMBus only, so there the old path is emulated with SMBus
+ * byte transfers and the new path uses one block read per device. On a
+ * real controller (e.g. the Pi's i2c-1) the new path is one I2C_RDWR ioctl
+ * for the whole sample.
+ */
+
+#define ITERATIONS 10000
+#define MAX_DEVS 16
+#define READ_LEN 2
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static int smbus_access(int fd, char rw, unsigned char cmd, int size,
+                        union i2c_smbus_data *data){
+  struct i2c_smbus_ioctl_data args = { rw, cmd, size, data };
+  return ioctl(fd, I2C_SMBUS, &args);
+}
+
+/* One sample over all devices the way access_i2c*.c used to do it */
+static int old_sample(struct i2c_bus *bus, unsigned short *addrs, int n,
+                      unsigned char *buf){
+  for(int i = 0; i < n; i++){
+    unsigned char reg = 0x00;
+
+    bus->syscalls++;
+    if(ioctl(bus->fd, I2C_SLAVE, addrs[i]) < 0){
+      return -1;
+    }
+
+    if(bus->funcs & I2C_FUNC_I2C){
+      bus->syscalls += 2;
+      if(write(bus->fd, &reg, 1) != 1 || read(bus->fd, buf, READ_LEN) != READ_LEN){
+        return -1;
+      }
+    } else {
+      union i2c_smbus_data data;
+
+      bus->syscalls++;
+      if(smbus_access(bus->fd, I2C_SMBUS_WRITE, reg, I2C_SMBUS_BYTE, NULL) < 0){
+        return -1;
+      }
+      for(int j = 0; j < READ_LEN; j++){
+        bus->syscalls++;
+        if(smbus_access(bus->fd, I2C_SMBUS_READ, 0, I2C_SMBUS_BYTE, &data) < 0){
+          return -1;
+        }
+        buf[j] = data.byte;
+      }
+    }
+  }
+  /* The old path leaves the slave address set, force the next I2C_SLAVE */
+  bus->cur_addr = -1;
+  return 0;
+}
+
+static void report(const char *name, double secs, unsigned long syscalls, int n){
+  printf("%-8s %10.0f samples/s %10.0f transactions/s %6.2f syscalls/sample\n",
+         name, ITERATIONS / secs, ITERATIONS * n / secs,
+         (double)syscalls / ITERATIONS);
+}
+
+int main(int argc, char *argv[]){
+  struct i2c_bus bus;
+  unsigned short addrs[MAX_DEVS] = { 0x42, 0x48 };
+  unsigned char bufs[MAX_DEVS][READ_LEN];
+  struct i2c_xfer x[MAX_DEVS];
+  int n = 2;
+
+  if(argc < 2){
+    printf("Usage: %s /dev/i2c-N [addr...]\n", argv[0]);
+    return -1;
+  }
+  if(argc > 2){
+    n = 0;
+    for(int i = 2; i < argc && n < MAX_DEVS; i++){
+      addrs[n++] = strtoul(argv[i], NULL, 0);
+    }
+  }
+
+  if(i2c_bus_open(&bus, argv[1]) < 0){
+    printf("Error: %s \n", strerror(errno));
+    return -1;
+  }
+  printf("%s: %s adapter, %i devices\n", argv[1],
+         bus.funcs & I2C_FUNC_I2C ? "I2C" : "SMBus-only", n);
+
+  for(int i = 0; i < n; i++){
+    x[i] = (struct i2c_xfer){ .addr = addrs[i], .reg = 0x00,
+                              .buf = bufs[i], .len = READ_LEN };
+  }
+
+  bus.syscalls = 0;
+  double start = now();
+  for(int i = 0; i < ITERATIONS; i++){
+    if(old_sample(&bus, addrs, n, bufs[0]) < 0){
+      printf("old path error: %s \n", strerror(errno));
+      return -1;
+    }
+  }
+  report("old", now() - start, bus.syscalls, n);
+
+  bus.syscalls = 0;
+  start = now();
+  for(int i = 0; i < ITERATIONS; i++){
+    if(i2c_bus_xfer(&bus, x, n) < 0){
+      printf("batched path error: %s \n", strerror(errno));
+      return -1;
+    }
+  }
+  report("batched", now() - start, bus.syscalls, n);
+
+  i2c_bus_close(&bus);
+  return 0;
+}
@@ -0,0 +1,150 @@
+#ifndef I2C_BUS_H
+#define I2C_BUS_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <sys/ioctl.h>
+#include <linux/i2c.h>
+#include <linux/i2c-dev.h>
+
+/*
+ * Small I2C access layer on top of /dev/i2c-N.
+ *
+ * A register read is the pointer write and the data read combined into one
+ * I2C_RDWR ioctl (repeated start, no stop in between), and any number of
+ * such reads - also to different devices - can be batched into the same
+ * ioctl. Adapters that only speak SMBus (e.g. i2c-stub) fall back to one
+ * I2C_SMBUS block read per device.
+ *
+ * bus->syscalls counts every ioctl/read/write issued, so callers can report
+ * syscalls per sample.
+ */
+
+struct i2c_bus {
+  int fd;
+  unsigned long funcs;      // I2C_FUNCS of the adapter
+  int cur_addr;             // last I2C_SLAVE address, SMBus fallback only
+  unsigned long syscalls;
+};
+
+struct i2c_xfer {
+  unsigned short addr;      // 7-bit slave address
+  int reg;                  // register pointer to write first, -1 for none
+  unsigned char *buf;       // receive buffer
+  unsigned short len;       // bytes to read
+  unsigned char reg_buf;    // private, holds reg for the write message
+};
+
+static inline int i2c_bus_open(struct i2c_bus *bus, const char *path){
+  bus->fd = open(path, O_RDWR);
+  bus->cur_addr = -1;
+  bus->syscalls = 0;
+  bus->funcs = 0;
+  if(bus->fd < 0){
+    return -1;
+  }
+
+  if(ioctl(bus->fd, I2C_FUNCS, &bus->funcs) < 0){
+    close(bus->fd);
+    return -1;
+  }
+  return 0;
+}
+
+static inline void i2c_bus_close(struct i2c_bus *bus){
+  close(bus->fd);
+  bus->fd = -1;
+}
+
+/* SMBus-only adapters: one I2C_SLAVE on address change + one block read */
+static inline int i2c_bus_xfer_smbus(struct i2c_bus *bus, struct i2c_xfer *x){
+  union i2c_smbus_data data;
+  struct i2c_smbus_ioctl_data args = {
+    .read_write = I2C_SMBUS_READ,
+    .data = &data,
+  };
+
+  if(x->len > I2C_SMBUS_BLOCK_MAX){
+    errno = EINVAL;
+    return -1;
+  }
+
+  if(bus->cur_addr != x->addr){
+    bus->syscalls++;
+    if(ioctl(bus->fd, I2C_SLAVE, x->addr) < 0){
+      return -1;
+    }
+    bus->cur_addr = x->addr;
+  }
+
+  if(x->reg >= 0){
+    args.command = x->reg;
+    args.size = I2C_SMBUS_I2C_BLOCK_DATA;
+    data.block[0] = x->len;
+    bus->syscalls++;
+    if(ioctl(bus->fd, I2C_SMBUS, &args) < 0){
+      return -1;
+    }
+    memcpy(x->buf, &data.block[1], x->len);
+    return 0;
+  }
+
+  args.size = I2C_SMBUS_BYTE;
+  for(int i = 0; i < x->len; i++){
+    bus->syscalls++;
+    if(ioctl(bus->fd, I2C_SMBUS, &args) < 0){
+      return -1;
+    }
+    x->buf[i] = data.byte;
+  }
+  return 0;
+}
+
+/*
+ * Run n transfers. On a plain I2C adapter this is a single I2C_RDWR ioctl
+ * (split only if it exceeds I2C_RDWR_IOCTL_MAX_MSGS messages).
+ */
+static inline int i2c_bus_xfer(struct i2c_bus *bus, struct i2c_xfer *x, int n){
+  struct i2c_msg msgs[I2C_RDWR_IOCTL_MAX_MSGS];
+  struct i2c_rdwr_ioctl_data rdwr = { .msgs = msgs };
+
+  if(!(bus->funcs & I2C_FUNC_I2C)){
+    for(int i = 0; i < n; i++){
+      if(i2c_bus_xfer_smbus(bus, &x[i]) < 0){
+        return -1;
+      }
+    }
+    return 0;
+  }
+
+  int nmsgs = 0;
+  for(int i = 0; i < n; i++){
+    if(x[i].reg >= 0){
+      x[i].reg_buf = x[i].reg;
+      msgs[nmsgs++] = (struct i2c_msg){ x[i].addr, 0, 1, &x[i].reg_buf };
+    }
+    msgs[nmsgs++] = (struct i2c_msg){ x[i].addr, I2C_M_RD, x[i].len, x[i].buf };
+
+    /* Flush when the next transfer might not fit */
+    if(nmsgs > I2C_RDWR_IOCTL_MAX_MSGS - 2 || i == n - 1){
+      rdwr.nmsgs = nmsgs;
+      bus->syscalls++;
+      if(ioctl(bus->fd, I2C_RDWR, &rdwr) < 0){
+        return -1;
+      }
+      nmsgs = 0;
+    }
+  }
+  return 0;
+}
+
+/* Convenience wrapper for a single device, reg = -1 for a plain read */
+static inline int i2c_bus_read(struct i2c_bus *bus, unsigned short addr, int reg,
+                               unsigned char *buf, unsigned short len){
+  struct i2c_xfer x = { .addr = addr, .reg = reg, .buf = buf, .len = len };
+  return i2c_bus_xfer(bus, &x, 1);
+}
+
+#endif
@@ -0,0 +1,15 @@
+#!/bin/sh
+# Compare the file based page (httpd serving /www/pages/index.html, written by
+# the old access_i2c_web) with the embedded server in access_i2c_web.
+# Prints requests/sec and the latency distribution (incl. p99) from wrk.
+#
+# Usage: ./web_bench.sh [file-url] [embedded-url]
+
+FILE_URL=${1:-http://127.0.0.1/index.html}
+EMBEDDED_URL=${2:-http://127.0.0.1:8080/}
+DURATION=${DURATION:-10s}
+
+for url in "$FILE_URL" "$EMBEDDED_URL" "${EMBEDDED_URL%/}/temp.json"; do
+    echo "=== $url"
+    wrk -t2 -c32 -d"$DURATION" --latency "$url" | grep -E "Requests/sec|99%|50%"
+done
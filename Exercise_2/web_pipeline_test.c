@@ -0,0 +1,126 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <unistd.h>
+#include <string.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <sys/time.h>
+#include <netinet/in.h>
+#include <arpa/inet.h>
+
+/*
+ * Pipelining test for access_i2c_web.
+ *
+ *   web_pipeline_test [-n requests] [host] [port]
+ *
+ * One thread sends n keep-alive GETs back to back while the main thread
+ * waits a second before it starts reading, so the responses overflow the
+ * socket buffers (several MB on loopback) and the server has to stall and
+ * resume in the middle of its buffered requests. Once everything is sent
+ * the responses are read slowly, so the server also stalls on its last
+ * batch, when no more requests arrive to wake it. Every request must be
+ * answered; a missing response shows up as a read timeout and the test
+ * fails.
+ *
+ * Build: gcc -o web_pipeline_test web_pipeline_test.c -lpthread
+ */
+
+#define DEFAULT_REQUESTS 100000
+#define RCVBUF 4096
+#define SLOW_READ 256
+
+static const char req[] = "GET /temp.json HTTP/1.1\r\nHost: test\r\n\r\n";
+
+static int sock;
+static int requests = DEFAULT_REQUESTS;
+static volatile int sent;
+
+static void *sender_run(void *arg){
+  (void)arg;
+  for(int i = 0; i < requests; i++){
+    if(write(sock, req, sizeof(req) - 1) != sizeof(req) - 1){
+      printf("Error sending request %d: %s \n", i, strerror(errno));
+      break;
+    }
+  }
+  sent = 1;
+  return NULL;
+}
+
+int main(int argc, char *argv[]){
+  const char *host = "127.0.0.1";
+  int port = 8080;
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:")) != -1){
+    if(opt == 'n'){
+      requests = atoi(optarg);
+    } else {
+      printf("Usage: %s [-n requests] [host] [port]\n", argv[0]);
+      return -1;
+    }
+  }
+  if(optind < argc){
+    host = argv[optind++];
+  }
+  if(optind < argc){
+    port = atoi(argv[optind]);
+  }
+
+  sock = socket(AF_INET, SOCK_STREAM, 0);
+  int rcvbuf = RCVBUF; /* small, so the server's writes stall early */
+  setsockopt(sock, SOL_SOCKET, SO_RCVBUF, &rcvbuf, sizeof(rcvbuf));
+  struct timeval tv = { .tv_sec = 5 };
+  setsockopt(sock, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+
+  struct sockaddr_in addr = { .sin_family = AF_INET, .sin_port = htons(port) };
+  inet_pton(AF_INET, host, &addr.sin_addr);
+  if(connect(sock, (struct sockaddr *)&addr, sizeof(addr)) < 0){
+    printf("Error connecting to %s:%d: %s \n", host, port, strerror(errno));
+    return -1;
+  }
+
+  pthread_t sender;
+  pthread_create(&sender, NULL, sender_run, NULL);
+  sleep(1);
+
+  /* Count responses: header, then Content-Length bytes of body */
+  static char buf[65536];
+  int len = 0, answered = 0;
+  while(answered < requests){
+    size_t want = sizeof(buf) - len;
+    if(sent){
+      want = want < SLOW_READ ? want : SLOW_READ;
+      usleep(50);
+    }
+    ssize_t n = read(sock, buf + len, want);
+    if(n <= 0){
+      printf("%s after %d of %d responses\n", n < 0 ? strerror(errno) : "EOF", answered, requests);
+      break;
+    }
+    len += n;
+
+    char *p = buf;
+    char *hdr_end;
+    while((hdr_end = memmem(p, buf + len - p, "\r\n\r\n", 4)) != NULL){
+      char *cl = memmem(p, hdr_end - p, "Content-Length: ", 16);
+      int body = cl ? atoi(cl + 16) : 0;
+      if(hdr_end + 4 + body > buf + len){
+        break;
+      }
+      p = hdr_end + 4 + body;
+      answered++;
+    }
+    len -= p - buf;
+    memmove(buf, p, len);
+  }
+
+  pthread_join(sender, NULL);
+  close(sock);
+
+  printf("pipelined %d requests: %d answered, %s\n", requests, answered,
+         answered == requests ? "ok" : "FAILED");
+  return answered == requests ? 0 : 1;
+}
@@ -0,0 +1,189 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+#include <sys/ioctl.h>
+#include <linux/gpio.h>
+
+/*
+ * Timestamps the edges of the LED waveform generated by ledread's PWM engine
+ * and reports period and duty jitter seen from outside the driver.
+ *
+ *   ledjitter -c /dev/gpiochipN -l offset [-n edges]
+ *       Kernel timestamped edge events through the GPIO v2 uAPI. On the Pi,
+ *       jumper GPIO 26 to a free input and give that input's offset.
+ *
+ *   ledjitter -s /sys/devices/platform/gpio-sim.0/gpiochipN/sim_gpioK/value
+ *       Busy-samples a gpio-sim line (insmod ledread.ko led_gpio=<base+K>).
+ *       gpio-sim has no edge events on lines driven by a kernel consumer, so
+ *       the resolution is one sysfs read.
+ *
+ * Build: gcc -o ledjitter ledjitter.c -lm
+ *
+ * Start the waveform first, e.g.  echo "pwm 1000000 250000" > /dev/led0
+ */
+
+#define DEFAULT_EDGES 10000
+
+struct stats {
+  uint64_t n;
+  double sum, sumsq;
+  uint64_t min, max;
+};
+
+static void stats_add(struct stats *s, uint64_t v){
+  if(s->n == 0 || v < s->min){
+    s->min = v;
+  }
+  if(v > s->max){
+    s->max = v;
+  }
+  s->n++;
+  s->sum += v;
+  s->sumsq += (double)v * v;
+}
+
+static void stats_print(const char *name, struct stats *s){
+  if(s->n == 0){
+    printf("%-7s no samples\n", name);
+    return;
+  }
+  double mean = s->sum / s->n;
+  double var = s->sumsq / s->n - mean * mean;
+  printf("%-7s n=%llu mean=%.0f ns min=%llu max=%llu p-p jitter=%llu ns stddev=%.0f ns\n",
+         name, (unsigned long long)s->n, mean, (unsigned long long)s->min,
+         (unsigned long long)s->max, (unsigned long long)(s->max - s->min),
+         var > 0 ? sqrt(var) : 0);
+}
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static struct stats high, low, period;
+static uint64_t last_rise, last_fall;
+
+static void edge(int rising, uint64_t ts){
+  if(rising){
+    if(last_rise){
+      stats_add(&period, ts - last_rise);
+    }
+    if(last_fall){
+      stats_add(&low, ts - last_fall);
+    }
+    last_rise = ts;
+  } else {
+    if(last_rise){
+      stats_add(&high, ts - last_rise);
+    }
+    last_fall = ts;
+  }
+}
+
+static int run_chardev(const char *chip, unsigned int offset, long edges){
+  struct gpio_v2_line_request req;
+  struct gpio_v2_line_event ev[16];
+
+  int fd = open(chip, O_RDONLY | O_CLOEXEC);
+  if(fd < 0){
+    return -1;
+  }
+  memset(&req, 0, sizeof(req));
+  req.offsets[0] = offset;
+  req.num_lines = 1;
+  req.config.flags = GPIO_V2_LINE_FLAG_INPUT | GPIO_V2_LINE_FLAG_EDGE_RISING |
+                     GPIO_V2_LINE_FLAG_EDGE_FALLING;
+  req.event_buffer_size = 1024;
+  strcpy(req.consumer, "ledjitter");
+  int ret = ioctl(fd, GPIO_V2_GET_LINE_IOCTL, &req);
+  close(fd);
+  if(ret < 0){
+    return -1;
+  }
+
+  while(edges > 0){
+    ssize_t n = read(req.fd, ev, sizeof(ev));
+    if(n < 0){
+      return -1;
+    }
+    for(size_t i = 0; i < n / sizeof(ev[0]); i++, edges--){
+      edge(ev[i].id == GPIO_V2_LINE_EVENT_RISING_EDGE, ev[i].timestamp_ns);
+    }
+  }
+  close(req.fd);
+  return 0;
+}
+
+static int run_sysfs(const char *path, long edges){
+  char c;
+  int fd = open(path, O_RDONLY);
+  if(fd < 0 || pread(fd, &c, 1, 0) != 1){
+    return -1;
+  }
+
+  int level = c == '1';
+  while(edges > 0){
+    if(pread(fd, &c, 1, 0) != 1){
+      return -1;
+    }
+    if((c == '1') != level){
+      level = !level;
+      edge(level, now_ns());
+      edges--;
+    }
+  }
+  close(fd);
+  return 0;
+}
+
+int main(int argc, char *argv[]){
+  const char *chip = NULL, *sim = NULL;
+  unsigned int offset = 0;
+  long edges = DEFAULT_EDGES;
+  int opt, ret;
+
+  while((opt = getopt(argc, argv, "c:l:s:n:")) != -1){
+    switch(opt){
+      case 'c':
+        chip = optarg;
+        break;
+      case 'l':
+        offset = strtoul(optarg, NULL, 0);
+        break;
+      case 's':
+        sim = optarg;
+        break;
+      case 'n':
+        edges = atol(optarg);
+        break;
+      default:
+        chip = sim = NULL;
+        break;
+    }
+  }
+
+  if(chip != NULL){
+    ret = run_chardev(chip, offset, edges);
+  } else if(sim != NULL){
+    ret = run_sysfs(sim, edges);
+  } else {
+    printf("Usage: %s -c chip -l offset | -s sim_value_path [-n edges]\n", argv[0]);
+    return -1;
+  }
+  if(ret < 0){
+    printf("Error: %s \n", strerror(errno));
+    return -1;
+  }
+
+  stats_print("period", &period);
+  stats_print("high", &high);
+  stats_print("low", &low);
+  return 0;
+}
@@ -4,33 +4,159 @@
 #include <linux/device.h>
 #include <linux/uaccess.h>
 #include <linux/module.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/workqueue.h>
+#include <linux/math64.h>
 
 #define LED_MAJOR 62
 #define LED_MINOR 0
 #define LED_MINOR_AMOUNT 1
-#define LED_GPIO 26
+#define LED_PWM_MIN_PERIOD_NS 10000 // Don't let a typo lock up the CPU
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Rene Street");
 MODULE_DESCRIPTION("LED device driver for fHAT");
 
+/* Overridable so the driver can be pointed at a gpio-sim line */
+static int led_gpio = 26;
+module_param(led_gpio, int, 0444);
+MODULE_PARM_DESC(led_gpio, "GPIO number of the LED (default 26)");
+
 static int devno;
 
 static struct cdev led_cdev;
 struct file_operations led_fops;
 
+/*
+ * Kernel side blink/PWM engine. Userspace writes "pwm <period_ns> <duty_ns>"
+ * once and the hrtimer keeps the waveform running. The line is high for
+ * duty_ns from epoch + k * period_ns; every expiry works out the level from
+ * (now - epoch) % period_ns and sleeps until the next edge of that grid, so
+ * lateness never accumulates and a late expiry skips the missed edges
+ * rather than catching up in a burst. The lateness of every expiry against
+ * its edge is recorded as jitter. On a controller that may sleep the pin is
+ * set later from a work item, so there the jitter is the lateness of the
+ * timer callback, not of the pin edge.
+ */
+struct led_pwm {
+    struct mutex ctl_lock;   // start, stop and the parameters below
+    struct hrtimer timer;
+    struct work_struct work; // sets the pin on controllers that may sleep
+    spinlock_t lock;         // jitter statistics
+    u64 period_ns;
+    u64 duty_ns;
+    ktime_t epoch;      // start of the first period
+    int running;
+    int level;          // level driven by the last edge
+
+    /* Edge jitter statistics, lateness of the edge vs its deadline */
+    u64 edges;
+    u64 jitter_sum_ns;
+    u64 jitter_max_ns;
+};
+
+static struct led_pwm led_pwm;
+
+static void led_pwm_work(struct work_struct *work){
+    struct led_pwm *pwm = container_of(work, struct led_pwm, work);
+
+    gpio_set_value_cansleep(led_gpio, pwm->level);
+}
+
+static enum hrtimer_restart led_pwm_timer(struct hrtimer *timer){
+    struct led_pwm *pwm = container_of(timer, struct led_pwm, timer);
+    ktime_t now = hrtimer_cb_get_time(timer);
+    s64 late = ktime_to_ns(ktime_sub(now, hrtimer_get_expires(timer)));
+    unsigned long flags;
+    u64 pos;
+
+    /* Position in the current period decides the level and the next edge */
+    div64_u64_rem(ktime_to_ns(ktime_sub(now, pwm->epoch)), pwm->period_ns, &pos);
+    pwm->level = pos < pwm->duty_ns;
+    if(gpio_cansleep(led_gpio)){
+        schedule_work(&pwm->work);
+    } else {
+        gpio_set_value(led_gpio, pwm->level);
+    }
+
+    spin_lock_irqsave(&pwm->lock, flags);
+    if(late < 0){
+        late = 0;
+    }
+    pwm->edges++;
+    pwm->jitter_sum_ns += late;
+    if(late > pwm->jitter_max_ns){
+        pwm->jitter_max_ns = late;
+    }
+    spin_unlock_irqrestore(&pwm->lock, flags);
+
+    /* Falling edge at duty_ns into the period, rising edge at its end */
+    hrtimer_set_expires(timer, ktime_add_ns(ktime_sub_ns(now, pos),
+                                            pwm->level ? pwm->duty_ns : pwm->period_ns));
+
+    return HRTIMER_RESTART;
+}
+
+/* Called with ctl_lock held, like led_pwm_start() */
+static void led_pwm_stop(struct led_pwm *pwm){
+    hrtimer_cancel(&pwm->timer);
+    cancel_work_sync(&pwm->work);
+    pwm->running = 0;
+}
+
+static int led_pwm_start(struct led_pwm *pwm, u64 period_ns, u64 duty_ns){
+    unsigned long flags;
+
+    if(period_ns < LED_PWM_MIN_PERIOD_NS || duty_ns > period_ns){
+        return -EINVAL;
+    }
+
+    led_pwm_stop(pwm);
+
+    spin_lock_irqsave(&pwm->lock, flags);
+    pwm->period_ns = period_ns;
+    pwm->duty_ns = duty_ns;
+    pwm->edges = 0;
+    pwm->jitter_sum_ns = 0;
+    pwm->jitter_max_ns = 0;
+    spin_unlock_irqrestore(&pwm->lock, flags);
+
+    /* 0% and 100% need no timer */
+    if(duty_ns == 0 || duty_ns == period_ns){
+        gpio_set_value_cansleep(led_gpio, duty_ns != 0);
+        return 0;
+    }
+
+    pwm->level = 1;
+    gpio_set_value_cansleep(led_gpio, 1);
+    pwm->running = 1;
+    pwm->epoch = ktime_get();
+    hrtimer_start(&pwm->timer, ktime_add_ns(pwm->epoch, duty_ns), HRTIMER_MODE_ABS);
+
+    return 0;
+}
+
 static int __init led_init(void){
     //variable til fejl behandling
     int err = 0;
 
     //request GPIO 16. with NULL label
-    err = gpio_request(LED_GPIO, NULL);
+    err = gpio_request(led_gpio, NULL);
     if(err < 0 ){
         goto err_exit;
     }
 
     //Set GPIO port as output
-    gpio_direction_output(LED_GPIO, 0);
+    gpio_direction_output(led_gpio, 0);
+
+    mutex_init(&led_pwm.ctl_lock);
+    spin_lock_init(&led_pwm.lock);
+    hrtimer_init(&led_pwm.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    led_pwm.timer.function = led_pwm_timer;
+    INIT_WORK(&led_pwm.work, led_pwm_work);
 
     //statisk allokering af major/minor number
     //create nodes med mknod
@@ -54,7 +180,7 @@ static int __init led_init(void){
     err_dev_unregister:
         unregister_chrdev_region(devno, LED_MINOR_AMOUNT); //unregister devices if error
     gpio_err:
-        gpio_free(LED_GPIO); //release claimed GPIO
+        gpio_free(led_gpio); //release claimed GPIO
     err_exit:
         return err;
 }
@@ -64,7 +190,11 @@ static void __exit led_exit(void){
 
     unregister_chrdev_region(devno, LED_MINOR_AMOUNT); //unregister device
 
-    gpio_free(LED_GPIO); //release claimed GPIO
+    mutex_lock(&led_pwm.ctl_lock);
+    led_pwm_stop(&led_pwm); //stop the waveform before releasing the pin
+    mutex_unlock(&led_pwm.ctl_lock);
+
+    gpio_free(led_gpio); //release claimed GPIO
 }
 
 int ledgpio_open(struct inode *inode, struct file *filep){
@@ -91,10 +221,31 @@ ssize_t ledgpio_read(struct file *filep, char __user *buf,
     size_t count, loff_t *f_pos){
 
     int val;
-    char valbuf[16];
-
-    val = gpio_get_value(LED_GPIO);
-    sprintf(valbuf, "%d", val);
+    char valbuf[192];
+
+    mutex_lock(&led_pwm.ctl_lock);
+    if(led_pwm.running){
+        /* While the engine runs report it and the jitter achieved so far */
+        unsigned long flags;
+        u64 edges, sum, max;
+
+        spin_lock_irqsave(&led_pwm.lock, flags);
+        edges = led_pwm.edges;
+        sum = led_pwm.jitter_sum_ns;
+        max = led_pwm.jitter_max_ns;
+        spin_unlock_irqrestore(&led_pwm.lock, flags);
+
+        /* jitter_of: what the lateness was measured on, see struct led_pwm */
+        snprintf(valbuf, sizeof(valbuf),
+                 "pwm %llu %llu edges %llu jitter_avg_ns %llu jitter_max_ns %llu jitter_of %s\n",
+                 led_pwm.period_ns, led_pwm.duty_ns, edges,
+                 edges ? div64_u64(sum, edges) : 0, max,
+                 gpio_cansleep(led_gpio) ? "callback" : "edge");
+    } else {
+        val = gpio_get_value(led_gpio);
+        sprintf(valbuf, "%d", val);
+    }
+    mutex_unlock(&led_pwm.ctl_lock);
 
     int valbuf_len = strlen(valbuf) + 1;
     valbuf_len = valbuf_len > count ? count : valbuf_len;
@@ -110,17 +261,39 @@ ssize_t ledgpio_read(struct file *filep, char __user *buf,
 
 ssize_t ledgpio_write(struct file *filep, const char __user *ubuf, size_t count, loff_t *f_pos){
 
-    char write_buf[count];
+    char write_buf[64];
     int write_val;
+    unsigned long long period_ns, duty_ns;
 
-    unsigned long err = copy_from_user(write_buf, ubuf, count);
-    if(err < 0){
-        printk("Error copying from user");
+    /* Commands are short, anything longer is a mistake */
+    if(count >= sizeof(write_buf)){
+        return -EINVAL;
+    }
+
+    if(copy_from_user(write_buf, ubuf, count)){
+        return -EFAULT;
     }
+    write_buf[count] = '\0';
 
-    sscanf(write_buf, "%d", &write_val);
+    /* "pwm <period_ns> <duty_ns>" starts the kernel waveform */
+    if(sscanf(write_buf, "pwm %llu %llu", &period_ns, &duty_ns) == 2){
+        int err;
+
+        mutex_lock(&led_pwm.ctl_lock);
+        err = led_pwm_start(&led_pwm, period_ns, duty_ns);
+        mutex_unlock(&led_pwm.ctl_lock);
+        return err ? err : count;
+    }
+
+    if(sscanf(write_buf, "%d", &write_val) != 1){
+        return -EINVAL;
+    }
 
-    gpio_set_value(LED_GPIO, write_val);
+    /* A plain value stops any running waveform */
+    mutex_lock(&led_pwm.ctl_lock);
+    led_pwm_stop(&led_pwm);
+    gpio_set_value_cansleep(led_gpio, write_val);
+    mutex_unlock(&led_pwm.ctl_lock);
 
     return count;
 }
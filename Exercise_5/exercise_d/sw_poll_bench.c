@@ -0,0 +1,105 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/epoll.h>
+
+#include "swread.h"
+
+/*
+ * Watches N input devices from a single thread with epoll.
+ *
+ *   sw_poll_bench [-d seconds] /dev/sw1 /dev/gpio101 ...
+ *
+ * Records from the sw driver carry the ISR timestamp, so for those the
+ * wake-to-read latency (edge in the ISR -> record in userspace) is measured
+ * per event and summarised as p50/p99/max. plat_drv nodes only deliver the
+ * current level, so for them the number of wakeups is reported.
+ */
+
+#define MAX_DEVS 64
+#define MAX_SAMPLES 100000
+
+static uint64_t lat[MAX_SAMPLES];
+static int lat_len;
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b){
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]){
+  struct sw_event ev[64];
+  unsigned long wakeups[MAX_DEVS] = { 0 };
+  unsigned long events = 0;
+  int fds[MAX_DEVS];
+  int seconds = 10;
+  int ndevs = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "d:")) != -1){
+    if(opt == 'd'){
+      seconds = atoi(optarg);
+    }
+  }
+  if(optind >= argc){
+    printf("Usage: %s [-d seconds] device...\n", argv[0]);
+    return -1;
+  }
+
+  int epfd = epoll_create1(0);
+  for(int i = optind; i < argc && ndevs < MAX_DEVS; i++, ndevs++){
+    fds[ndevs] = open(argv[i], O_RDONLY | O_NONBLOCK);
+    if(fds[ndevs] < 0){
+      printf("Error opening %s: %s \n", argv[i], strerror(errno));
+      return -1;
+    }
+    struct epoll_event e = { .events = EPOLLIN, .data.u32 = ndevs };
+    epoll_ctl(epfd, EPOLL_CTL_ADD, fds[ndevs], &e);
+  }
+
+  uint64_t end = now_ns() + seconds * 1000000000ULL;
+  struct epoll_event ready[MAX_DEVS];
+
+  while(now_ns() < end){
+    int n = epoll_wait(epfd, ready, MAX_DEVS, 100);
+
+    for(int i = 0; i < n; i++){
+      int d = ready[i].data.u32;
+      ssize_t len = read(fds[d], ev, sizeof(ev));
+      uint64_t t = now_ns();
+
+      wakeups[d]++;
+      if(len < (ssize_t)sizeof(ev[0]) || len % sizeof(ev[0]) != 0){
+        continue; // plat_drv level, no timestamp
+      }
+      for(size_t j = 0; j < len / sizeof(ev[0]); j++, events++){
+        if(lat_len < MAX_SAMPLES){
+          lat[lat_len++] = t - ev[j].ts_ns;
+        }
+      }
+    }
+  }
+
+  for(int i = 0; i < ndevs; i++){
+    printf("%-20s %lu wakeups\n", argv[optind + i], wakeups[i]);
+  }
+
+  if(lat_len > 0){
+    qsort(lat, lat_len, sizeof(lat[0]), cmp_u64);
+    printf("%lu timestamped events, wake-to-read latency p50 %llu ns, p99 %llu ns, max %llu ns\n",
+           events, (unsigned long long)lat[lat_len / 2],
+           (unsigned long long)lat[lat_len * 99 / 100], (unsigned long long)lat[lat_len - 1]);
+  }
+  return 0;
+}
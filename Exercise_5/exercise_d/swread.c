@@ -7,9 +7,23 @@
 
 /* Interrupt header files */
 #include <linux/interrupt.h>
+#include <linux/irq.h>
 #include <linux/wait.h>
 #include <linux/sched.h>
 
+/* Event ring */
+#include <linux/mutex.h>
+#include <linux/spinlock.h>
+#include <linux/hrtimer.h>
+#include <linux/math64.h>
+#include <linux/ktime.h>
+#include <linux/slab.h>
+
+/* Readiness notification */
+#include <linux/poll.h>
+
+#include "swread.h"
+
 #define SW_MAJOR 24
 #define SW_MINOR 0
 #define SW_MINOR_AMOUNT 1
@@ -17,8 +31,10 @@
 
 //changed to gpio 19
 
-static int isr_gpio_value;
-static int proc_gpio_value;
+#define SW_RING_SIZE 256 // records, must be a power of 2
+#define SW_RING_MASK (SW_RING_SIZE - 1)
+/* The slot the ISR is writing is never handed out */
+#define SW_RING_READABLE (SW_RING_SIZE - 1)
 
 MODULE_LICENSE("Dual BSD/GPL");
 MODULE_AUTHOR("Rene Street");
@@ -30,10 +46,303 @@ static struct cdev sw_cdev;
 struct file_operations sw_fops;
 
 static irqreturn_t sw_gpio_isr(int irq, void *dev_id);
+static irqreturn_t sw_gpio_thread(int irq, void *dev_id);
+static enum hrtimer_restart sw_settle(struct hrtimer *timer);
+static enum hrtimer_restart sw_gate(struct hrtimer *timer);
 static unsigned int sw_gpio_irq;
 
+static struct class *sw_class;
+static struct device *sw_device;
+
+/* Trigger edge, set at load time (trigger=rising|falling|both) or in sysfs */
+static char *trigger = "rising";
+module_param(trigger, charp, 0444);
+MODULE_PARM_DESC(trigger, "Initial IRQ trigger edge: rising, falling or both");
+static unsigned int sw_trigger;
+
+/* How long the hard handler runs and how late the thread gets to run */
+static u64 sw_hardirq_max_ns;
+static u64 sw_thread_delay_max_ns;
+
+/*
+ * Debounce. The controller's own filter (gpio_set_debounce) is used when it
+ * has one. Otherwise every raw edge (re)starts an hrtimer and the edge is
+ * only accepted if the line has settled at the level the trigger asks for
+ * once the window has passed quietly. The accepted record keeps the
+ * timestamp of the first edge in the burst.
+ */
+static unsigned int sw_debounce_us;
+static bool sw_debounce_hw;
+static struct hrtimer sw_settle_timer;
+static DEFINE_SPINLOCK(sw_lock);     // ring producers and debounce state
+static bool sw_pending;
+static u64 sw_pending_ts;
+static int sw_stable_level;
+
+static unsigned long sw_raw_edges;
+static unsigned long sw_accepted_edges;
+
+/*
+ * Counter mode. The IRQ only counts edges (no records, no debounce, no
+ * wakeups) and a gate timer turns the count into a frequency once per
+ * gate_ms. Readers are woken once per gate and read struct sw_count.
+ * Period is measured between the first and last edge inside the gate, which
+ * stays accurate at low rates where edges/gate is only a handful.
+ */
+#define SW_GATE_MS_DEFAULT 1000
+
+static bool sw_counter_mode;
+static unsigned int sw_gate_ms = SW_GATE_MS_DEFAULT;
+static struct hrtimer sw_gate_timer;
+static u32 sw_gate_edges;       // edges in the running gate
+static u64 sw_gate_first_ts;
+static u64 sw_gate_last_ts;
+static u64 sw_count_total;
+static struct sw_count sw_count_last; // result of the last complete gate
+static u32 sw_gate_seq;                // bumped once per gate
+
 static DECLARE_WAIT_QUEUE_HEAD(read_wait);
-static int read_flag = 0;
+static struct fasync_struct *sw_async_queue;
+
+/*
+ * Edges are written by the ISR or the debounce timer (under sw_lock, readers
+ * never take it) into one shared ring and never consumed from it. Every open
+ * file has its own cursor (the sequence number of the next record it wants),
+ * so all readers see every event, copied straight from the ring to
+ * userspace. A reader that falls more than a ring behind skips ahead and is
+ * told how much it lost.
+ */
+static struct sw_event sw_ring[SW_RING_SIZE];
+static u32 sw_head; // sequence number of the next record to be written
+
+struct sw_file {
+    struct mutex lock;  // serialises readers sharing this file
+    u32 cursor;
+    u32 lost;           // records this reader has missed in total
+    bool overflowed;    // flag the next record handed out
+    u32 gate_seen;      // counter mode: last gate handed out
+};
+
+/* Append an accepted edge to the ring, called with sw_lock held */
+static void sw_push_event(u64 ts, int level){
+    u32 head = sw_head;
+    struct sw_event *ev = &sw_ring[head & SW_RING_MASK];
+
+    ev->ts_ns = ts;
+    ev->seq = head;
+    ev->level = level;
+    ev->flags = 0;
+
+    /* Publish the record only once it is complete */
+    smp_store_release(&sw_head, head + 1);
+    sw_accepted_edges++;
+}
+
+static const struct {
+    const char *name;
+    unsigned int flags;
+} sw_triggers[] = {
+    { "rising",  IRQF_TRIGGER_RISING },
+    { "falling", IRQF_TRIGGER_FALLING },
+    { "both",    IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING },
+};
+
+static int sw_parse_trigger(const char *buf, unsigned int *flags){
+    for(int i = 0; i < ARRAY_SIZE(sw_triggers); i++){
+        if(sysfs_streq(buf, sw_triggers[i].name)){
+            *flags = sw_triggers[i].flags;
+            return 0;
+        }
+    }
+    return -EINVAL;
+}
+
+/* sysfs: /sys/class/sw_class/sw1/trigger */
+static ssize_t trigger_show(struct device *dev, struct device_attribute *attr, char *buf){
+    for(int i = 0; i < ARRAY_SIZE(sw_triggers); i++){
+        if(sw_triggers[i].flags == sw_trigger){
+            return sprintf(buf, "%s\n", sw_triggers[i].name);
+        }
+    }
+    return -EINVAL;
+}
+
+static ssize_t trigger_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    unsigned int flags;
+    int err = sw_parse_trigger(buf, &flags);
+    if(err){
+        return err;
+    }
+
+    err = irq_set_irq_type(sw_gpio_irq, flags);
+    if(err){
+        return err;
+    }
+    sw_trigger = flags;
+
+    return size;
+}
+
+/* sysfs: /sys/class/sw_class/sw1/irq_stats, writing anything resets it */
+static ssize_t irq_stats_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sprintf(buf, "hardirq_max_ns %llu thread_delay_max_ns %llu\n",
+                   READ_ONCE(sw_hardirq_max_ns), READ_ONCE(sw_thread_delay_max_ns));
+}
+
+static ssize_t irq_stats_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    WRITE_ONCE(sw_hardirq_max_ns, 0);
+    WRITE_ONCE(sw_thread_delay_max_ns, 0);
+    return size;
+}
+
+/* sysfs: /sys/class/sw_class/sw1/debounce_us, 0 disables the filter */
+static ssize_t debounce_us_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sprintf(buf, "%u\n", sw_debounce_us);
+}
+
+static ssize_t debounce_us_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    unsigned int us;
+    unsigned long flags;
+    int err = kstrtouint(buf, 0, &us);
+    if(err){
+        return err;
+    }
+
+    /* Prefer the hardware filter, fall back to the hrtimer one */
+    bool hw = gpio_set_debounce(SW_GPIO, us) == 0;
+
+    hrtimer_cancel(&sw_settle_timer);
+    spin_lock_irqsave(&sw_lock, flags);
+    sw_debounce_hw = hw;
+    sw_debounce_us = us;
+    sw_pending = false;
+    sw_stable_level = gpio_get_value(SW_GPIO);
+    spin_unlock_irqrestore(&sw_lock, flags);
+
+    return size;
+}
+
+static ssize_t debounce_hw_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sprintf(buf, "%d\n", sw_debounce_hw);
+}
+
+/* Raw edges seen by the IRQ vs edges that made it into the ring */
+static ssize_t raw_edges_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sprintf(buf, "%lu\n", READ_ONCE(sw_raw_edges));
+}
+
+static ssize_t accepted_edges_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sprintf(buf, "%lu\n", READ_ONCE(sw_accepted_edges));
+}
+
+/* sysfs: /sys/class/sw_class/sw1/mode, "events" or "counter" */
+static ssize_t mode_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sprintf(buf, "%s\n", sw_counter_mode ? "counter" : "events");
+}
+
+static ssize_t mode_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    unsigned long flags;
+    bool counter;
+
+    if(sysfs_streq(buf, "counter")){
+        counter = true;
+    } else if(sysfs_streq(buf, "events")){
+        counter = false;
+    } else {
+        return -EINVAL;
+    }
+
+    hrtimer_cancel(&sw_gate_timer);
+    hrtimer_cancel(&sw_settle_timer);
+
+    spin_lock_irqsave(&sw_lock, flags);
+    sw_counter_mode = counter;
+    sw_pending = false;
+    sw_gate_edges = 0;
+    sw_count_total = 0;
+    memset(&sw_count_last, 0, sizeof(sw_count_last));
+    spin_unlock_irqrestore(&sw_lock, flags);
+
+    if(counter){
+        hrtimer_start(&sw_gate_timer, ms_to_ktime(sw_gate_ms), HRTIMER_MODE_REL);
+    }
+    wake_up_interruptible(&read_wait); // blocked readers switch format
+
+    return size;
+}
+
+static ssize_t gate_ms_show(struct device *dev, struct device_attribute *attr, char *buf){
+    return sprintf(buf, "%u\n", sw_gate_ms);
+}
+
+static ssize_t gate_ms_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    unsigned int ms;
+    int err = kstrtouint(buf, 0, &ms);
+    if(err){
+        return err;
+    }
+    if(ms == 0){
+        return -EINVAL;
+    }
+
+    WRITE_ONCE(sw_gate_ms, ms); // takes effect from the next gate
+    return size;
+}
+
+/* Aggregate of the last complete gate */
+static ssize_t count_show(struct device *dev, struct device_attribute *attr, char *buf){
+    unsigned long flags;
+    struct sw_count c;
+
+    spin_lock_irqsave(&sw_lock, flags);
+    c = sw_count_last;
+    spin_unlock_irqrestore(&sw_lock, flags);
+
+    return sprintf(buf, "total %llu edges %u gate_ms %u period_ns %llu freq_mhz %llu\n",
+                   c.total, c.edges, c.gate_ms, c.period_ns, c.freq_mhz);
+}
+
+static DEVICE_ATTR_RW(trigger);
+static DEVICE_ATTR_RW(irq_stats);
+static DEVICE_ATTR_RW(mode);
+static DEVICE_ATTR_RW(gate_ms);
+static DEVICE_ATTR_RO(count);
+static DEVICE_ATTR_RW(debounce_us);
+static DEVICE_ATTR_RO(debounce_hw);
+static DEVICE_ATTR_RO(raw_edges);
+static DEVICE_ATTR_RO(accepted_edges);
+
+static struct attribute *sw_attrs[] = {
+    &dev_attr_trigger.attr,
+    &dev_attr_irq_stats.attr,
+    &dev_attr_debounce_us.attr,
+    &dev_attr_debounce_hw.attr,
+    &dev_attr_raw_edges.attr,
+    &dev_attr_accepted_edges.attr,
+    &dev_attr_mode.attr,
+    &dev_attr_gate_ms.attr,
+    &dev_attr_count.attr,
+    NULL,
+};
+
+static const struct attribute_group sw_group = {
+    .attrs = sw_attrs,
+};
+
+static const struct attribute_group *sw_groups[] = {
+    &sw_group,
+    NULL,
+};
 
 static int __init sw_init(void){
     //variable til fejl behandling
@@ -51,6 +360,34 @@ static int __init sw_init(void){
         goto gpio_err;
     }
 
+    err = sw_parse_trigger(trigger, &sw_trigger);
+    if(err){
+        printk("sw_gpio: unknown trigger \"%s\"\n", trigger);
+        goto gpio_err;
+    }
+
+    hrtimer_init(&sw_settle_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    sw_settle_timer.function = sw_settle;
+    hrtimer_init(&sw_gate_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    sw_gate_timer.function = sw_gate;
+    sw_stable_level = gpio_get_value(SW_GPIO);
+
+    /* Requested before the device is created, its trigger attribute reconfigures this IRQ */
+    sw_gpio_irq = gpio_to_irq(SW_GPIO);
+
+    /*
+     * The hard handler only timestamps and records the edge, everything
+     * else runs in the IRQ thread. No IRQF_ONESHOT: the line stays unmasked
+     * so edges are still timestamped while the thread is delayed.
+     */
+    err = request_threaded_irq(sw_gpio_irq, sw_gpio_isr, sw_gpio_thread,
+                               sw_trigger, "sw_gpio_irq", NULL);
+    if(err){
+        printk("sw_gpio: can't get assigned irq %d\n", sw_gpio_irq);
+        goto gpio_err;
+    }
+    printk("sw_gpio: got assigned irq nr. %d\n", sw_gpio_irq);
+
     //statisk allokering af major/minor number
     //create nodes med mknod
     devno = MKDEV(SW_MAJOR, SW_MINOR);
@@ -58,7 +395,7 @@ static int __init sw_init(void){
     //Register device
     err = register_chrdev_region(devno, SW_MINOR_AMOUNT, "sw1");
     if(err < 0){
-        goto gpio_err;
+        goto err_free_irq;
     }
 
     //Tell kernel about the cdev structure - Final step
@@ -68,19 +405,31 @@ static int __init sw_init(void){
         goto err_dev_unregister;
     }
 
-    sw_gpio_irq = gpio_to_irq(SW_GPIO);
+    //Class device for the sysfs attributes
+    sw_class = class_create(THIS_MODULE, "sw_class");
+    if(IS_ERR(sw_class)){
+        err = PTR_ERR(sw_class);
+        goto err_cdev_del;
+    }
+    sw_class->dev_groups = sw_groups;
 
-    err = request_irq(sw_gpio_irq, &sw_gpio_isr, IRQF_TRIGGER_RISING, "sw_gpio_irq", NULL);
-    if(err){
-        printk("sw_gpio: can't get assigned irq %d\n", sw_gpio_irq);
-    } else {
-        printk("sw_gpio: got assigned irq nr. %d\n", sw_gpio_irq);
+    sw_device = device_create(sw_class, NULL, devno, NULL, "sw1");
+    if(IS_ERR(sw_device)){
+        err = PTR_ERR(sw_device);
+        goto err_class_destroy;
     }
 
     return 0; //Success
 
+    err_class_destroy:
+        class_destroy(sw_class);
+    err_cdev_del:
+        cdev_del(&sw_cdev);
     err_dev_unregister:
         unregister_chrdev_region(devno, SW_MINOR_AMOUNT); //unregister devices if error
+    err_free_irq:
+        free_irq(sw_gpio_irq, NULL);
+        hrtimer_cancel(&sw_settle_timer);
     gpio_err:
         gpio_free(SW_GPIO); //release claimed GPIO
     err_exit:
@@ -88,7 +437,13 @@ static int __init sw_init(void){
 }
 
 static void __exit sw_exit(void){
+    /* The attributes go first, they drive the IRQ and the timers */
+    device_destroy(sw_class, devno);
+    class_destroy(sw_class);
+
     free_irq(sw_gpio_irq, NULL);
+    hrtimer_cancel(&sw_settle_timer);
+    hrtimer_cancel(&sw_gate_timer);
 
     cdev_del(&sw_cdev); //Delete added cdev
 
@@ -99,48 +454,191 @@ static void __exit sw_exit(void){
 
 int swgpio_open(struct inode *inode, struct file *filep){
     int major, minor;
+    struct sw_file *sf;
 
     major = MAJOR(inode->i_rdev);
     minor = MINOR(inode->i_rdev);
     printk("Opening SWGpio Device [major], [minor]: %i, %i\n", major, minor);
 
+    sf = kzalloc(sizeof(*sf), GFP_KERNEL);
+    if(!sf){
+        return -ENOMEM;
+    }
+    mutex_init(&sf->lock);
+    sf->cursor = smp_load_acquire(&sw_head); //only events from now on
+    sf->gate_seen = READ_ONCE(sw_gate_seq);
+    filep->private_data = sf;
+
     return 0;
 }
 
+int swgpio_fasync(int fd, struct file *filep, int on){
+    return fasync_helper(fd, filep, on, &sw_async_queue);
+}
+
 int swgpio_release(struct inode *inode, struct file *filep){
     int minor, major;
 
+    swgpio_fasync(-1, filep, 0); //drop SIGIO registration of this file
+
     major = MAJOR(inode->i_rdev);
     minor = MINOR(inode->i_rdev);
     printk("Closing/Releasing SWGpio Device [major], [minor]: %i, %i\n", major, minor);
 
+    kfree(filep->private_data);
+
     return 0;
 }
 
+/* Counter mode read: one struct sw_count per gate */
+static ssize_t swgpio_read_count(struct file *filep, char __user *buf,
+    size_t count, loff_t *f_pos){
+
+    struct sw_file *sf = filep->private_data;
+    unsigned long flags;
+    struct sw_count c;
+
+    if(count < sizeof(c)){
+        return -EINVAL;
+    }
+
+    while(READ_ONCE(sw_gate_seq) == sf->gate_seen){
+        if(filep->f_flags & O_NONBLOCK){
+            return -EAGAIN;
+        }
+        if(wait_event_interruptible(read_wait, READ_ONCE(sw_gate_seq) != sf->gate_seen ||
+                                               !READ_ONCE(sw_counter_mode))){
+            return -ERESTARTSYS;
+        }
+        if(!READ_ONCE(sw_counter_mode)){
+            return -EAGAIN;
+        }
+    }
+
+    spin_lock_irqsave(&sw_lock, flags);
+    c = sw_count_last;
+    sf->gate_seen = sw_gate_seq;
+    spin_unlock_irqrestore(&sw_lock, flags);
+
+    if(copy_to_user(buf, &c, sizeof(c))){
+        return -EFAULT;
+    }
+
+    *f_pos += sizeof(c);
+    return sizeof(c);
+}
+
 ssize_t swgpio_read(struct file *filep, char __user *buf,
     size_t count, loff_t *f_pos){
 
-    wait_event_interruptible(read_wait, read_flag != 0);
-    read_flag = 0;
+    struct sw_file *sf = filep->private_data;
+    struct sw_event __user *ubuf = (struct sw_event __user *)buf;
+    u32 max = min_t(size_t, count / sizeof(struct sw_event), SW_RING_READABLE);
+    u32 head, start, first, n;
 
-    proc_gpio_value = gpio_get_value(SW_GPIO);
+    if(READ_ONCE(sw_counter_mode)){
+        return swgpio_read_count(filep, buf, count, f_pos);
+    }
+
+    /* Only whole records are handed out */
+    if(max == 0){
+        return -EINVAL;
+    }
+
+    if(mutex_lock_interruptible(&sf->lock)){
+        return -ERESTARTSYS;
+    }
 
-    //int val;
-    char valbuf[16];
+    while((head = smp_load_acquire(&sw_head)) == sf->cursor){
+        mutex_unlock(&sf->lock);
+
+        if(filep->f_flags & O_NONBLOCK){
+            return -EAGAIN;
+        }
+        if(wait_event_interruptible(read_wait, smp_load_acquire(&sw_head) != sf->cursor ||
+                                               READ_ONCE(sw_counter_mode))){
+            return -ERESTARTSYS;
+        }
+        /* Switched to counter mode while blocked, no more edges will come */
+        if(READ_ONCE(sw_counter_mode)){
+            return swgpio_read_count(filep, buf, count, f_pos);
+        }
+        if(mutex_lock_interruptible(&sf->lock)){
+            return -ERESTARTSYS;
+        }
+    }
 
+    while(1){
+        /* Skip records the ISR has already overwritten */
+        if(head - sf->cursor > SW_RING_READABLE){
+            u32 skip = head - sf->cursor - SW_RING_READABLE;
+
+            sf->lost += skip;
+            sf->cursor += skip;
+            sf->overflowed = true;
+        }
+
+        /* Copy directly out of the ring, in two parts if it wraps */
+        n = min(head - sf->cursor, max);
+        start = sf->cursor & SW_RING_MASK;
+        first = min(n, (u32)SW_RING_SIZE - start);
+        if(copy_to_user(ubuf, &sw_ring[start], first * sizeof(struct sw_event)) ||
+           copy_to_user(ubuf + first, &sw_ring[0], (n - first) * sizeof(struct sw_event))){
+            mutex_unlock(&sf->lock);
+            return -EFAULT;
+        }
+
+        /* Done unless the ISR lapped us while we were copying */
+        smp_rmb();
+        head = READ_ONCE(sw_head);
+        if(head - sf->cursor <= SW_RING_READABLE){
+            break;
+        }
+    }
 
-    sprintf(valbuf, "%i%i ", proc_gpio_value, isr_gpio_value);
+    if(sf->overflowed && put_user((u16)SW_EVENT_OVERFLOW, &ubuf[0].flags) == 0){
+        sf->overflowed = false;
+    }
+    sf->cursor += n;
 
-    int valbuf_len = strlen(valbuf) + 1;
-    valbuf_len = valbuf_len > count ? count : valbuf_len;
+    mutex_unlock(&sf->lock);
 
-    unsigned long err = copy_to_user(buf, valbuf, valbuf_len);
-    if(err < 0){
-        printk("Error copying to user");
+    *f_pos += n * sizeof(struct sw_event);
+    return n * sizeof(struct sw_event);
+}
+
+/* Per reader lag and loss */
+long swgpio_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+    struct sw_file *sf = filep->private_data;
+    struct sw_status st;
+
+    switch(cmd){
+        case SW_IOC_STATUS:
+            mutex_lock(&sf->lock);
+            st.lag = smp_load_acquire(&sw_head) - sf->cursor;
+            st.lost = sf->lost;
+            mutex_unlock(&sf->lock);
+
+            if(copy_to_user((void __user *)arg, &st, sizeof(st))){
+                return -EFAULT;
+            }
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
+/* Readable when this file has not yet seen the newest edge */
+__poll_t swgpio_poll(struct file *filep, poll_table *wait){
+    struct sw_file *sf = filep->private_data;
+
+    poll_wait(filep, &read_wait, wait);
+
+    if(READ_ONCE(sw_counter_mode)){
+        return READ_ONCE(sw_gate_seq) != READ_ONCE(sf->gate_seen) ? EPOLLIN | EPOLLRDNORM : 0;
     }
 
-    *f_pos += valbuf_len;
-    return valbuf_len;
+    return smp_load_acquire(&sw_head) != READ_ONCE(sf->cursor) ? EPOLLIN | EPOLLRDNORM : 0;
 }
 
 //Point to implemented file operations methods
@@ -149,15 +647,122 @@ struct file_operations sw_fops = {
     .open       = swgpio_open,
     .release    = swgpio_release,
     .read       = swgpio_read,
+    .poll       = swgpio_poll,
+    .fasync     = swgpio_fasync,
+    .unlocked_ioctl = swgpio_ioctl,
 };
 
+/* Hard IRQ: timestamp and record (or just count) the edge, nothing else */
 static irqreturn_t sw_gpio_isr(int irq, void *dev_id){
-    //printk("IRQ event at irq line: %i\n", sw_gpio_irq); //debugging purposes
+    u64 now = ktime_get_ns();
+    irqreturn_t ret = IRQ_WAKE_THREAD;
+
+    spin_lock(&sw_lock);
+    sw_raw_edges++;
+
+    if(sw_counter_mode){
+        /* Just count, the gate timer does the rest */
+        if(sw_gate_edges++ == 0){
+            sw_gate_first_ts = now;
+        }
+        sw_gate_last_ts = now;
+        sw_count_total++;
+        ret = IRQ_HANDLED;
+    } else if(sw_debounce_us == 0 || sw_debounce_hw){
+        sw_push_event(now, gpio_get_value(SW_GPIO));
+    } else {
+        /* Bouncing: hold the edge until the line has been quiet */
+        if(!sw_pending){
+            sw_pending = true;
+            sw_pending_ts = now;
+        }
+        hrtimer_start(&sw_settle_timer, ns_to_ktime((u64)sw_debounce_us * NSEC_PER_USEC),
+                      HRTIMER_MODE_REL);
+        ret = IRQ_HANDLED;
+    }
+    spin_unlock(&sw_lock);
+
+    now = ktime_get_ns() - now;
+    if(now > sw_hardirq_max_ns){
+        WRITE_ONCE(sw_hardirq_max_ns, now);
+    }
+
+    return ret;
+}
+
+/* Debounce window passed without new edges: accept if it settled as triggered */
+static enum hrtimer_restart sw_settle(struct hrtimer *timer){
+    unsigned long flags;
+    bool accept;
+    int level;
+
+    /* Sampled under the lock, so an edge in between cannot be judged on a stale level */
+    spin_lock_irqsave(&sw_lock, flags);
+    level = gpio_get_value(SW_GPIO);
+    if(sw_trigger == (IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING)){
+        accept = level != sw_stable_level;
+    } else {
+        accept = level == (sw_trigger == IRQF_TRIGGER_RISING);
+    }
+    accept = accept && sw_pending;
+    if(accept){
+        sw_push_event(sw_pending_ts, level);
+    }
+    sw_stable_level = level;
+    sw_pending = false;
+    spin_unlock_irqrestore(&sw_lock, flags);
+
+    if(accept){
+        wake_up_interruptible(&read_wait);
+        kill_fasync(&sw_async_queue, SIGIO, POLL_IN);
+    }
+
+    return HRTIMER_NORESTART;
+}
+
+/* End of a gate interval: publish the aggregate and wake readers once */
+static enum hrtimer_restart sw_gate(struct hrtimer *timer){
+    unsigned long flags;
+    unsigned int gate_ms = READ_ONCE(sw_gate_ms);
+    /* With both edges triggering, two edges make one signal period */
+    u64 edges_per_period = sw_trigger == (IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING) ? 2 : 1;
+
+    spin_lock_irqsave(&sw_lock, flags);
+    sw_count_last.ts_ns = ktime_get_ns();
+    sw_count_last.total = sw_count_total;
+    sw_count_last.edges = sw_gate_edges;
+    sw_count_last.gate_ms = gate_ms;
+    sw_count_last.period_ns = 0;
+    sw_count_last.freq_mhz = 0;
+    if(sw_gate_edges >= 2){
+        sw_count_last.period_ns = div64_u64((sw_gate_last_ts - sw_gate_first_ts) * edges_per_period,
+                                            sw_gate_edges - 1);
+    }
+    if(sw_count_last.period_ns){
+        sw_count_last.freq_mhz = div64_u64(1000000000000ULL, sw_count_last.period_ns);
+    }
+    sw_gate_edges = 0;
+    sw_gate_seq++;
+    spin_unlock_irqrestore(&sw_lock, flags);
 
-    read_flag = 1;
     wake_up_interruptible(&read_wait);
+    kill_fasync(&sw_async_queue, SIGIO, POLL_IN);
+
+    hrtimer_forward_now(timer, ms_to_ktime(gate_ms));
+    return HRTIMER_RESTART;
+}
 
-    isr_gpio_value = gpio_get_value(SW_GPIO);
+/* IRQ thread: wake readers, may run well after the edge */
+static irqreturn_t sw_gpio_thread(int irq, void *dev_id){
+    u32 head = smp_load_acquire(&sw_head);
+    u64 delay = ktime_get_ns() - sw_ring[(head - 1) & SW_RING_MASK].ts_ns;
+
+    if(delay > sw_thread_delay_max_ns){
+        WRITE_ONCE(sw_thread_delay_max_ns, delay);
+    }
+
+    wake_up_interruptible(&read_wait);
+    kill_fasync(&sw_async_queue, SIGIO, POLL_IN);
 
     return IRQ_HANDLED;
 }
@@ -0,0 +1,37 @@
+#ifndef SWREAD_H
+#define SWREAD_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/* Binary record returned by read() on the sw device, one per edge */
+struct sw_event {
+    __u64 ts_ns;    // CLOCK_MONOTONIC time of the edge, taken in the ISR
+    __u32 seq;      // edge sequence number, a gap means records were dropped
+    __u16 level;    // line level sampled in the ISR
+    __u16 flags;
+};
+
+/* Set on the first record after this reader fell behind and lost records */
+#define SW_EVENT_OVERFLOW 0x0001
+
+/* Record returned by read() in counter mode, one per gate interval */
+struct sw_count {
+    __u64 ts_ns;        // CLOCK_MONOTONIC time the gate closed
+    __u64 total;        // edges since counter mode was enabled
+    __u32 edges;        // edges within this gate
+    __u32 gate_ms;
+    __u64 period_ns;    // mean signal period in the gate, 0 below two edges
+    __u64 freq_mhz;     // signal frequency in milli-Hertz
+};
+
+/* Lag and loss of the calling reader (open file) */
+struct sw_status {
+    __u32 lag;      // records written but not yet read by this file
+    __u32 lost;     // records this file missed because it fell a ring behind
+};
+
+#define SW_IOC_MAGIC 's'
+#define SW_IOC_STATUS _IOR(SW_IOC_MAGIC, 1, struct sw_status)
+
+#endif
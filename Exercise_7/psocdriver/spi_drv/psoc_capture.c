@@ -0,0 +1,115 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <math.h>
+
+#include "spi_drv.h"
+
+/*
+ * Captures the continuous acquisition of one spi_drv channel and reports
+ * the rate and timing actually achieved.
+ *
+ *   echo 1000 > /sys/class/spi_drv_class/acq_rate_hz
+ *   echo 1 > /sys/class/spi_drv_class/acq_enable
+ *   psoc_capture [-d seconds] [-v] /dev/spi_drv0-ph
+ *
+ * The interval between consecutive sample timestamps is summarised as
+ * p50/p99/max and its spread around the mean (jitter). Gaps in seq are
+ * samples dropped on a full ring or failed scans. In acq_stats, ticks
+ * skipped because the bus was busy show up as bus_overruns, ticks that
+ * passed while the timer itself ran late as timer_overruns.
+ *
+ * Build: gcc -o psoc_capture psoc_capture.c -lm
+ */
+
+#define MAX_SAMPLES 1000000
+
+static struct psoc_sample samples[MAX_SAMPLES];
+static uint64_t intervals[MAX_SAMPLES];
+
+static uint64_t now_ns(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec * 1000000000ULL + ts.tv_nsec;
+}
+
+static int cmp_u64(const void *a, const void *b){
+  uint64_t x = *(const uint64_t *)a, y = *(const uint64_t *)b;
+  return x < y ? -1 : x > y;
+}
+
+int main(int argc, char *argv[]){
+  int seconds = 10;
+  int verbose = 0;
+  int n = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "d:v")) != -1){
+    if(opt == 'd'){
+      seconds = atoi(optarg);
+    } else if(opt == 'v'){
+      verbose = 1;
+    }
+  }
+  if(optind >= argc){
+    printf("Usage: %s [-d seconds] [-v] device\n", argv[0]);
+    return -1;
+  }
+
+  int fd = open(argv[optind], O_RDONLY);
+  if(fd < 0){
+    printf("Error opening %s: %s \n", argv[optind], strerror(errno));
+    return -1;
+  }
+
+  uint64_t end = now_ns() + seconds * 1000000000ULL;
+  while(now_ns() < end && n < MAX_SAMPLES){
+    ssize_t len = read(fd, &samples[n], (MAX_SAMPLES - n) * sizeof(samples[0]));
+    if(len <= 0){
+      printf("Acquisition not running or stopped: %s \n", len < 0 ? strerror(errno) : "EOF");
+      break;
+    }
+    if(len % sizeof(samples[0]) != 0){
+      printf("Not a binary sample stream, enable acquisition first\n");
+      return -1;
+    }
+    for(size_t i = 0; verbose && i < len / sizeof(samples[0]); i++){
+      printf("%llu %u %d\n", (unsigned long long)samples[n + i].ts_ns, samples[n + i].seq,
+             samples[n + i].value);
+    }
+    n += len / sizeof(samples[0]);
+  }
+  close(fd);
+
+  if(n < 2){
+    printf("%d samples, nothing to measure\n", n);
+    return 0;
+  }
+
+  uint64_t lost = 0;
+  double sum = 0, sumsq = 0;
+  for(int i = 1; i < n; i++){
+    intervals[i - 1] = samples[i].ts_ns - samples[i - 1].ts_ns;
+    lost += samples[i].seq - samples[i - 1].seq - 1;
+    sum += intervals[i - 1];
+    sumsq += (double)intervals[i - 1] * intervals[i - 1];
+  }
+
+  double span = (samples[n - 1].ts_ns - samples[0].ts_ns) / 1e9;
+  double mean = sum / (n - 1);
+  double var = sumsq / (n - 1) - mean * mean;
+  qsort(intervals, n - 1, sizeof(intervals[0]), cmp_u64);
+
+  printf("%d samples in %.3f s: %.1f samples/s, %llu samples dropped\n", n, span, (n - 1) / span,
+         (unsigned long long)lost);
+  printf("interval mean %.0f ns p50 %llu ns p99 %llu ns max %llu ns, jitter (stddev) %.0f ns\n",
+         mean, (unsigned long long)intervals[(n - 1) / 2],
+         (unsigned long long)intervals[(n - 1) * 99 / 100],
+         (unsigned long long)intervals[n - 2], var > 0 ? sqrt(var) : 0);
+  return 0;
+}
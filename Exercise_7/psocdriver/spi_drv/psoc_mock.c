@@ -0,0 +1,133 @@
+#include <linux/module.h> // module_init, GPL
+#include <linux/platform_device.h> // platform_device_register_simple
+#include <linux/spi/spi.h> // spi_alloc_master, spi_new_device
+#include <linux/delay.h> // udelay
+
+/*
+ * Stand-in for the PSoC, to run spi_drv without the hardware.
+ *
+ * Registers a software SPI controller with one device on chip select 0
+ * whose modalias is "spi_drv", so spi_drv probes on it exactly as on the
+ * real bus. The controller answers the PSoC protocol: a tx-only transfer
+ * is a command (the last byte is the channel id) and the following rx
+ * transfers clock out that channel's sample, big endian. Samples are
+ * channel * 1000 + a counter 0..99 that steps on every response, so
+ * consecutive reads differ and every channel is recognisable.
+ *
+ *   insmod psoc_mock.ko && insmod spi_drv.ko
+ *   cat /dev/spi_drv0-ph
+ *
+ * messages counts the SPI messages (bus transactions) the mock has seen,
+ * e.g. one per scan of all four channels by spi_drv.
+ */
+
+#define PSOC_MOCK_SAMPLE_LEN 2
+
+static unsigned int messages;
+module_param(messages, uint, 0444);
+MODULE_PARM_DESC(messages, "SPI messages transferred so far");
+
+static struct platform_device *psoc_mock_pdev;
+static struct spi_master *psoc_mock_master;
+
+/* Mock PSoC state, only touched from the controller's message pump */
+struct psoc_mock {
+    u8 response[PSOC_MOCK_SAMPLE_LEN];
+    int resp_pos;      // next response byte to clock out
+    unsigned int seq;  // sample counter
+};
+
+static void psoc_mock_command(struct psoc_mock *mock, u8 channel){
+    u16 sample = channel * 1000 + mock->seq++ % 100;
+
+    mock->response[0] = sample >> 8;
+    mock->response[1] = sample & 0xff;
+    mock->resp_pos = 0;
+}
+
+static int psoc_mock_transfer_one_message(struct spi_master *master, struct spi_message *msg){
+    struct psoc_mock *mock = spi_master_get_devdata(master);
+    struct spi_transfer *t;
+
+    list_for_each_entry(t, &msg->transfers, transfer_list) {
+        const u8 *tx = t->tx_buf;
+        u8 *rx = t->rx_buf;
+
+        if (tx && !rx && t->len)
+            psoc_mock_command(mock, tx[t->len - 1]);
+
+        for (unsigned int i = 0; rx && i < t->len; i++)
+            rx[i] = mock->resp_pos < PSOC_MOCK_SAMPLE_LEN ?
+                    mock->response[mock->resp_pos++] : 0;
+
+        if (t->delay_usecs)
+            udelay(t->delay_usecs);
+
+        msg->actual_length += t->len;
+    }
+
+    messages++;
+    msg->status = 0;
+    spi_finalize_current_message(master);
+    return 0;
+}
+
+static struct spi_board_info psoc_mock_board_info = {
+    .modalias = "spi_drv",
+    .max_speed_hz = 20000000,
+    .chip_select = 0,
+    .mode = SPI_MODE_0,
+};
+
+static int __init psoc_mock_init(void){
+    int err = 0;
+
+    psoc_mock_pdev = platform_device_register_simple("psoc_mock", -1, NULL, 0);
+    if (IS_ERR(psoc_mock_pdev))
+        return PTR_ERR(psoc_mock_pdev);
+
+    psoc_mock_master = spi_alloc_master(&psoc_mock_pdev->dev, sizeof(struct psoc_mock));
+    if (!psoc_mock_master) {
+        err = -ENOMEM;
+        goto err_pdev;
+    }
+
+    psoc_mock_master->bus_num = -1; // next free bus number
+    psoc_mock_master->num_chipselect = 1;
+    psoc_mock_master->mode_bits = SPI_CPOL | SPI_CPHA;
+    psoc_mock_master->bits_per_word_mask = SPI_BPW_MASK(8);
+    psoc_mock_master->transfer_one_message = psoc_mock_transfer_one_message;
+
+    err = spi_register_master(psoc_mock_master);
+    if (err) {
+        spi_master_put(psoc_mock_master);
+        goto err_pdev;
+    }
+
+    if (!spi_new_device(psoc_mock_master, &psoc_mock_board_info)) {
+        err = -ENODEV;
+        goto err_master;
+    }
+
+    printk("psoc_mock on SPI bus %d\n", psoc_mock_master->bus_num);
+    return 0;
+
+    err_master:
+    spi_unregister_master(psoc_mock_master);
+
+    err_pdev:
+    platform_device_unregister(psoc_mock_pdev);
+    return err;
+}
+
+static void __exit psoc_mock_exit(void){
+    /* Also unregisters the spi_drv device on the bus */
+    spi_unregister_master(psoc_mock_master);
+    platform_device_unregister(psoc_mock_pdev);
+}
+
+module_init(psoc_mock_init);
+module_exit(psoc_mock_exit);
+
+MODULE_DESCRIPTION("Mock PSoC SPI controller for spi_drv");
+MODULE_LICENSE("GPL");
@@ -0,0 +1,94 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "spi_drv.h"
+
+/*
+ * SPI throughput of spi_drv across transfer sizes, through PSOC_IOC_XFER
+ * (full duplex, the driver's preallocated DMA safe buffers).
+ *
+ *   psoc_spi_bench [-d seconds] [-s speed_hz] [device]
+ *
+ * Prints transfers/s and payload bytes/s per size. Small sizes show the
+ * per-message cost, large ones the bus rate; on the Pi the controller
+ * switches from PIO to DMA above a few dozen bytes.
+ *
+ * Build: gcc -o psoc_spi_bench psoc_spi_bench.c
+ */
+
+#define DEFAULT_DEV "/dev/spi_drv0-ph"
+
+static const unsigned int sizes[] = { 1, 4, 16, 64, 128, 256, 512, 1024, 2048, PSOC_XFER_MAX };
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+int main(int argc, char *argv[]){
+  static uint8_t tx[PSOC_XFER_MAX], rx[PSOC_XFER_MAX];
+  const char *dev = DEFAULT_DEV;
+  double seconds = 2;
+  unsigned int speed = 0;
+  int opt;
+
+  while((opt = getopt(argc, argv, "d:s:")) != -1){
+    switch(opt){
+      case 'd':
+        seconds = atof(optarg);
+        break;
+      case 's':
+        speed = strtoul(optarg, NULL, 0);
+        break;
+      default:
+        printf("Usage: %s [-d seconds] [-s speed_hz] [device]\n", argv[0]);
+        return -1;
+    }
+  }
+  if(optind < argc){
+    dev = argv[optind];
+  }
+
+  int fd = open(dev, O_RDWR);
+  if(fd < 0){
+    printf("Error opening %s: %s \n", dev, strerror(errno));
+    return -1;
+  }
+
+  for(size_t i = 0; i < sizeof(tx); i++){
+    tx[i] = i;
+  }
+
+  printf("%6s %12s %14s\n", "bytes", "transfers/s", "bytes/s");
+  for(size_t i = 0; i < sizeof(sizes) / sizeof(sizes[0]); i++){
+    struct psoc_xfer x = {
+      .tx_buf = (uintptr_t)tx,
+      .rx_buf = (uintptr_t)rx,
+      .len = sizes[i],
+      .speed_hz = speed,
+    };
+    long n = 0;
+
+    double start = now(), t;
+    do{
+      if(ioctl(fd, PSOC_IOC_XFER, &x) < 0){
+        printf("Error: %s \n", strerror(errno));
+        return -1;
+      }
+      n++;
+    } while((t = now() - start) < seconds);
+
+    printf("%6u %12.0f %14.0f\n", sizes[i], n / t, n * sizes[i] / t);
+  }
+
+  close(fd);
+  return 0;
+}
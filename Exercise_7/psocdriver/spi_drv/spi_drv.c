@@ -2,10 +2,37 @@
 #include <linux/uaccess.h>  // copy_to_user
 #include <linux/module.h> // module_init, GPL
 #include <linux/spi/spi.h> // spi_sync,
+#include <linux/ktime.h> // ktime_get_ns
+#include <linux/math64.h> // div_u64
+#include <linux/slab.h> // kmalloc
+#include <linux/mutex.h> // mutex_lock
+#include <linux/hrtimer.h> // hrtimer_start
+#include <linux/kfifo.h> // kfifo_put
+#include <linux/wait.h> // wait_event_interruptible
+#include <linux/spinlock.h> // spin_lock_irqsave
+#include <linux/dma-mapping.h> // dma_get_cache_alignment
+#include <linux/kref.h> // kref_get
+#include <linux/rwsem.h> // down_read
+#include <linux/iio/iio.h> // iio_device_register
+#include <linux/iio/buffer.h> // iio_push_to_buffers_with_timestamp
+#include <linux/iio/trigger_consumer.h> // iio_pollfunc_store_time
+#include <linux/iio/triggered_buffer.h> // iio_triggered_buffer_setup
+
+#include "spi_drv.h"
+#include <asm/unaligned.h> // get_unaligned_be16
 
 #define MAXLEN 32
 #define MODULE_DEBUG 1   // Enable/Disable Debug messages
 
+/*
+ * PSoC protocol: the master sends one command byte, the channel id, and
+ * then clocks out the sample as PSOC_SAMPLE_LEN bytes, big endian two's
+ * complement. The PSoC needs PSOC_RESP_DELAY_US after the command to load
+ * the sample into its TX buffer.
+ */
+#define PSOC_SAMPLE_LEN 2
+#define PSOC_RESP_DELAY_US 10
+
 /* Char Driver Globals */
 static struct spi_driver spi_drv_spi_driver;
 struct file_operations spi_drv_fops;
@@ -33,6 +60,121 @@ char subdev_names[4][5] = {
 struct Myspi spi_devs[4];
 const int spi_devs_len = 4;  // Max nbr of devices
 static int spi_devs_cnt = 0; // Nbr devices present
+static DEFINE_MUTEX(spi_devs_lock); // spi_devs and spi_devs_cnt, against open
+
+/*
+ * Snapshot of all channels, taken by one scan (one spi_message for all
+ * channels). Reads are served from it while it is younger than
+ * max_age_ms, so readers of the four minors share a scan; max_age_ms = 0
+ * reads each channel on its own.
+ */
+#define PSOC_CHANNELS ARRAY_SIZE(subdev_names)
+
+struct psoc_snapshot {
+    struct mutex lock;          // one scan at a time, protects below
+    s16 samples[PSOC_CHANNELS]; // indexed by channel
+    u64 ts_ns;                  // ktime_get_ns() at the end of the scan, 0: none
+};
+static struct psoc_snapshot psoc_snap;
+
+static unsigned int max_age_ms = 50;
+module_param(max_age_ms, uint, 0644);
+MODULE_PARM_DESC(max_age_ms, "Max age of the scan snapshot served to reads in ms, 0: no scan");
+
+/*
+ * Continuous acquisition: an hrtimer submits a scan of all channels with
+ * spi_async() every 1/acq_rate_hz, so the sampling rate no longer depends
+ * on when userspace calls read(). PSOC_ACQ_SLOTS scan messages allow the
+ * next scan to be queued while one is on the bus; a tick that finds every
+ * slot busy is counted in bus_overruns and skipped, ticks that passed while
+ * the timer itself ran late are counted in timer_overruns. Completions push a
+ * timestamped struct psoc_sample into the ring of each channel, a full
+ * ring drops the new sample and counts it in the channel's overruns.
+ * Controlled by the class attributes acq_enable, acq_rate_hz, acq_stats.
+ */
+#define PSOC_ACQ_SLOTS 2
+#define PSOC_ACQ_MAX_HZ 20000
+#define PSOC_RING_LEN 1024  // samples per channel, power of 2
+
+/* A scan of all channels in one message, see psoc_scan_init() */
+#define PSOC_SCAN_TX_LEN PSOC_CHANNELS
+#define PSOC_SCAN_RX_LEN (PSOC_CHANNELS * PSOC_SAMPLE_LEN)
+
+struct psoc_scan_msg {
+    struct spi_message message;
+    struct spi_transfer transfer[2 * PSOC_CHANNELS];
+    u8 *tx;                     // commands, PSOC_SCAN_TX_LEN bytes
+    u8 *rx;                     // samples, PSOC_SCAN_RX_LEN bytes
+};
+
+struct psoc_ring {
+    DECLARE_KFIFO(fifo, struct psoc_sample, PSOC_RING_LEN);
+    struct mutex read_lock;     // one reader at a time takes samples
+    wait_queue_head_t wait;
+    u64 overruns;               // samples dropped on a full ring
+};
+
+struct psoc_acq {
+    struct mutex lock;          // start, stop and rate changes
+    bool running;
+    unsigned int rate_hz;
+    struct spi_device *spi;
+    struct hrtimer timer;
+    struct psoc_scan_msg slot[PSOC_ACQ_SLOTS];
+    unsigned long busy;         // slots on the bus
+    atomic_t inflight;
+    wait_queue_head_t idle;     // woken when inflight drops to 0
+    struct psoc_ring ring[PSOC_CHANNELS]; // indexed by channel
+
+    /* Statistics since start, under stats_lock */
+    spinlock_t stats_lock;
+    u64 start_ns;
+    u64 ticks;
+    u64 scans;
+    u64 bus_overruns;           // ticks skipped, every slot on the bus
+    u64 timer_overruns;         // ticks that passed while the timer was late
+    u64 errors;
+    u32 seq;
+    u64 late_sum_ns;            // tick lateness vs its deadline
+    u64 late_max_ns;
+};
+static struct psoc_acq psoc_acq = { .rate_hz = 100 };
+
+/*
+ * Transfer state of a PSoC, allocated at probe (spi drvdata). tx and rx
+ * come from psoc_dma_alloc(), so they are DMA safe: not on the stack and
+ * never sharing a cacheline with other data, which lets the controller
+ * use DMA for large transfers instead of byte-wise PIO. They are plain
+ * kmalloc memory, not devm (devres data only has 8 byte alignment after
+ * its header), and freed by psoc_dev_free() with the last reference.
+ * The messages are built once at probe; a call only fills in the command
+ * and length.
+ *
+ * Open files can outlive the SPI device (unbind, unloading psoc_mock), so
+ * the state is refcounted like plat_drv's gpio_pdata: probe holds a
+ * reference until its devm resources are released and every open file
+ * holds one until release. After remove the file operations see gone and
+ * return -ENODEV; gone_lock lets remove wait for the ones still on the bus.
+ */
+struct psoc_dev {
+    struct spi_device *spi;
+    struct kref ref;                // probe and every open file
+    struct rw_semaphore gone_lock;  // held for reading around device access
+    bool gone;                      // removed
+    struct mutex lock;              // one user of the buffers at a time
+    u8 *tx;                         // PSOC_XFER_MAX bytes
+    u8 *rx;                         // PSOC_XFER_MAX bytes
+
+    struct spi_message read_msg;    // psoc_read_channel()
+    struct spi_transfer read_t[2];
+    struct psoc_scan_msg scan;      // psoc_scan()
+    struct spi_message bulk_msg;    // psoc_write_byte(), PSOC_IOC_XFER
+    struct spi_transfer bulk_t;
+};
+
+static enum hrtimer_restart psoc_acq_tick(struct hrtimer *timer);
+static int psoc_acq_sysfs_add(struct class *cls);
+static void psoc_acq_sysfs_del(struct class *cls);
 
 /* Macro to handle Errors */
 #define ERRGOTO(label, ...)                     \
@@ -54,6 +196,19 @@ static int __init spi_drv_init(void){
 
     printk("spi_drv driver initializing\n");
 
+    mutex_init(&psoc_snap.lock);
+
+    mutex_init(&psoc_acq.lock);
+    spin_lock_init(&psoc_acq.stats_lock);
+    init_waitqueue_head(&psoc_acq.idle);
+    hrtimer_init(&psoc_acq.timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    psoc_acq.timer.function = psoc_acq_tick;
+    for (int ch = 0; ch < PSOC_CHANNELS; ch++) {
+        INIT_KFIFO(psoc_acq.ring[ch].fifo);
+        mutex_init(&psoc_acq.ring[ch].read_lock);
+        init_waitqueue_head(&psoc_acq.ring[ch].wait);
+    }
+
     /* Allocate major number and register fops*/
     err = alloc_chrdev_region(&devno, 0, 255, "spi_drv driver");
 
@@ -74,17 +229,25 @@ static int __init spi_drv_init(void){
     if (IS_ERR(spi_drv_class))
         ERRGOTO(err_cleanup_cdev, "Failed to create class");
 
+    err = psoc_acq_sysfs_add(spi_drv_class);
+
+    if (err)
+        ERRGOTO(err_cleanup_class, "Failed to create acquisition attributes\n");
+
     /* Register SPI Driver */
-    /* THIS WILL INVOKE PROBE, IF DEVICE IS PRESENT!!! */
+    /* Probe runs asynchronously if the device is present, init does not wait */
     err = spi_register_driver(&spi_drv_spi_driver);
 
     if(err)
-        ERRGOTO(err_cleanup_class, "Failed SPI Registration\n");
+        ERRGOTO(err_cleanup_attrs, "Failed SPI Registration\n");
 
     /* Success */
     return 0;
 
     /* Errors during Initialization */
+    err_cleanup_attrs:
+    psoc_acq_sysfs_del(spi_drv_class);
+
     err_cleanup_class:
     class_destroy(spi_drv_class);
 
@@ -105,6 +268,7 @@ static void __exit spi_drv_exit(void){
     printk("spi_drv driver Exit\n");
 
     spi_unregister_driver(&spi_drv_spi_driver);
+    psoc_acq_sysfs_del(spi_drv_class);
     class_destroy(spi_drv_class);
     cdev_del(&spi_drv_cdev);
     unregister_chrdev_region(devno, 255);
@@ -112,22 +276,71 @@ static void __exit spi_drv_exit(void){
 
 /* Helper functions for read and write */
 
-int psoc_write_byte(struct spi_device *spi, u8 data){
-    int err = 0;
+/*
+ * DMA safe buffer: kmalloc starts it on a cacheline (ARCH_KMALLOC_MINALIGN)
+ * and the length is rounded up to whole cachelines, so nothing else shares
+ * them. Freed with kfree().
+ */
+static u8 *psoc_dma_alloc(size_t len){
+    return kzalloc(ALIGN(len, dma_get_cache_alignment()), GFP_KERNEL);
+}
 
-    struct spi_transfer transfer[1]; /* One transfer */
-    struct spi_message message;
+static void psoc_dev_free(struct kref *ref){
+    struct psoc_dev *st = container_of(ref, struct psoc_dev, ref);
+
+    kfree(st->tx);
+    kfree(st->rx);
+    kfree(st->scan.tx);
+    kfree(st->scan.rx);
+    kfree(st);
+}
+
+/* Also probe's devm action, which runs after the IIO device (registered later) is gone */
+static void psoc_dev_put(void *data){
+    struct psoc_dev *st = data;
+
+    kref_put(&st->ref, psoc_dev_free);
+}
 
-    memset(transfer, 0, sizeof(transfer)); /* Init memory */
-    spi_message_init(&message);     /* Init Message */
-    message.spi = spi;              /* Use current SPI interface */
+/* Device access of an open file, false once the device is removed */
+static bool psoc_dev_enter(struct psoc_dev *st){
+    down_read(&st->gone_lock);
+    if (st->gone) {
+        up_read(&st->gone_lock);
+        return false;
+    }
+    return true;
+}
+
+static void psoc_dev_exit(struct psoc_dev *st){
+    up_read(&st->gone_lock);
+}
+
+/*
+ * Transfer len bytes from st->tx through the prebuilt bulk message, full
+ * duplex into st->rx when rx is set. Called with st->lock held.
+ */
+static int psoc_xfer_locked(struct spi_device *spi, struct psoc_dev *st,
+                            unsigned int len, bool rx, u32 speed_hz){
+    st->bulk_t.len = len;
+    st->bulk_t.rx_buf = rx ? st->rx : NULL;
+    st->bulk_t.speed_hz = speed_hz;     /* 0: the device's max speed */
 
-    transfer[0].tx_buf = &data;            /* Transmit data */
-    transfer[0].rx_buf = NULL;             /* Receive no data */
-    transfer[0].len = 1;                   /* Transfer size in bytes */
-    spi_message_add_tail(&transfer[0], &message);   /* Add message to queue */
+    return spi_sync(spi, &st->bulk_msg);  /* Blocking transmit */
+}
+
+int psoc_write_byte(struct spi_device *spi, u8 data){
+    struct psoc_dev *st;
+    int err = 0;
 
-    err = spi_sync(message.spi, &message);  /* Blocking transmit */
+    if (!spi)
+        return -ENODEV;
+    st = spi_get_drvdata(spi);
+
+    mutex_lock(&st->lock);
+    st->tx[0] = data;
+    err = psoc_xfer_locked(spi, st, 1, false, 0);
+    mutex_unlock(&st->lock);
 
     return err;
 }
@@ -138,35 +351,34 @@ int psoc_write_byte(struct spi_device *spi, u8 data){
 ssize_t spi_drv_write(struct file *filep, const char __user *ubuf,
                       size_t count, loff_t *f_pos)
 {
-    int minor, len, value;
+    int minor, len, value, err;
     char kbuf[MAXLEN];
 
     minor = iminor(filep->f_inode);
 
-    printk(KERN_ALERT "Writing to spi_drv [Minor] %i \n", minor);
-
-    /* Limit copy length to MAXLEN allocated andCopy from user */
-    len = count < MAXLEN ? count : MAXLEN;
+    /* Limit copy length to MAXLEN - 1, leaving room for the termination */
+    len = count < MAXLEN - 1 ? count : MAXLEN - 1;
     if(copy_from_user(kbuf, ubuf, len))
         return -EFAULT;
 
     /* Pad null termination to string */
     kbuf[len] = '\0';
 
-    if(MODULE_DEBUG)
-        printk("string from user: %s\n", kbuf);
-
     /* Convert sting to int */
+    err = kstrtoint(strim(kbuf), 0, &value);
+    if (err)
+        return err;
 
-    sscanf(kbuf,"%i", &value);
-    if(MODULE_DEBUG)
-        printk("value %i\n", value);
+    pr_debug("spi_drv: write to minor %i: %i\n", minor, value);
 
-    /*
-    Do something with value ....
-    */
+    struct psoc_dev *st = filep->private_data;
 
-    psoc_write_byte(PSoC_spi_device, value);
+    if (!psoc_dev_enter(st))
+        return -ENODEV;
+    err = psoc_write_byte(st->spi, value);
+    psoc_dev_exit(st);
+    if (err)
+        return err;
 
     /* Legacy file ptr f_pos. Used to support
     * random access but in char drv we dont!
@@ -179,55 +391,418 @@ ssize_t spi_drv_write(struct file *filep, const char __user *ubuf,
 }
 
 /*
- * Character Driver Read File Operations Method
+ * Read one sample of a channel in a single spi_message: the command,
+ * the PSoC's load delay and the response. cs_change stays 0 on the
+ * command, so CS is held asserted into the response and only released
+ * at the end of the message; the PSoC sees one transaction per sample.
+ */
+static void psoc_read_init(struct psoc_dev *st, struct spi_device *spi){
+    memset(st->read_t, 0, sizeof(st->read_t));  /* Init memory */
+    spi_message_init(&st->read_msg);            /* Init message */
+    st->read_msg.spi = spi;                     /* Use current SPI I/F */
+
+    st->read_t[0].tx_buf = st->tx;              /* Channel id */
+    st->read_t[0].len = 1;
+    st->read_t[0].delay_usecs = PSOC_RESP_DELAY_US;
+    st->read_t[0].cs_change = 0;                /* Keep CS asserted */
+    spi_message_add_tail(&st->read_t[0], &st->read_msg);
+
+    st->read_t[1].rx_buf = st->rx;              /* Sample */
+    st->read_t[1].len = PSOC_SAMPLE_LEN;
+    spi_message_add_tail(&st->read_t[1], &st->read_msg);
+}
+
+int psoc_read_channel(struct spi_device *spi, int channel, s16 *sample){
+    struct psoc_dev *st = spi_get_drvdata(spi);
+    int err = 0;
+
+    mutex_lock(&st->lock);
+    st->tx[0] = channel;
+    err = spi_sync(spi, &st->read_msg);     /* Blocking transmit */
+    if (!err)
+        *sample = (s16)get_unaligned_be16(st->rx);
+    mutex_unlock(&st->lock);
+
+    return err;
+}
+
+/*
+ * Build a scan of all channels in one spi_message: a command/response
+ * pair per channel as in psoc_read_channel(), with cs_change set on every
+ * response but the last, so CS is released between channels and the PSoC
+ * sees one transaction per channel, while the bus sees one message.
+ * Commands and samples live in the separate m->tx and m->rx buffers.
  */
+static void psoc_scan_init(struct psoc_scan_msg *m, struct spi_device *spi){
+    memset(m->transfer, 0, sizeof(m->transfer));
+    spi_message_init(&m->message);
+    m->message.spi = spi;
+
+    for (int ch = 0; ch < PSOC_CHANNELS; ch++) {
+        struct spi_transfer *t = &m->transfer[2 * ch];
+
+        m->tx[ch] = ch;
+        t[0].tx_buf = &m->tx[ch];
+        t[0].len = 1;
+        t[0].delay_usecs = PSOC_RESP_DELAY_US;
+        spi_message_add_tail(&t[0], &m->message);
+
+        t[1].rx_buf = &m->rx[ch * PSOC_SAMPLE_LEN];
+        t[1].len = PSOC_SAMPLE_LEN;
+        t[1].cs_change = ch < PSOC_CHANNELS - 1; /* End this channel's transaction */
+        spi_message_add_tail(&t[1], &m->message);
+    }
+}
+
+static s16 psoc_scan_sample(struct psoc_scan_msg *m, int channel){
+    return (s16)get_unaligned_be16(&m->rx[channel * PSOC_SAMPLE_LEN]);
+}
+
+/* Read all channels in one blocking message */
+int psoc_scan(struct spi_device *spi, s16 *samples){
+    struct psoc_dev *st = spi_get_drvdata(spi);
+    int err = 0;
+
+    mutex_lock(&st->lock);
+    err = spi_sync(spi, &st->scan.message);
+    if (!err) {
+        for (int ch = 0; ch < PSOC_CHANNELS; ch++)
+            samples[ch] = psoc_scan_sample(&st->scan, ch);
+    }
+    mutex_unlock(&st->lock);
 
- int psoc_read_byte(struct spi_device *spi, u8 *data){
-     int err = 0;
+    return err;
+}
 
-     struct spi_transfer transfer[1];    /* Only one transfer */
-     struct spi_message message;
+/* Sample of a channel from a snapshot no older than max_age_ms, scanning if needed */
+int psoc_read_cached(struct spi_device *spi, int channel, s16 *sample){
+    u64 max_age = (u64)READ_ONCE(max_age_ms) * NSEC_PER_MSEC;
+    int err = 0;
 
-     memset(transfer, 0, sizeof(transfer));  /* Init memory */
-     spi_message_init(&message);             /* Init message */
-     message.spi = spi;                      /* Use current SPI I/F */
+    if (!max_age)
+        return psoc_read_channel(spi, channel, sample);
 
-     transfer[0].tx_buf = NULL;              /* Transmit no data */
-     transfer[0].rx_buf = data;              /* Receive data */
-     transfer[0].len = 1;                    /* Transfer size in bytes */
-     spi_message_add_tail(&transfer[0], &message); /* Add message to queue */
+    mutex_lock(&psoc_snap.lock);
+    if (!psoc_snap.ts_ns || ktime_get_ns() - psoc_snap.ts_ns > max_age) {
+        err = psoc_scan(spi, psoc_snap.samples);
+        psoc_snap.ts_ns = err ? 0 : ktime_get_ns();
+    }
+    if (!err)
+        *sample = psoc_snap.samples[channel];
+    mutex_unlock(&psoc_snap.lock);
+
+    return err;
+}
 
-     err = spi_sync(message.spi, &message); /* Blocking transmit */
+/* Completion of an acquisition scan, atomic context */
+static void psoc_acq_complete(void *context){
+    struct psoc_scan_msg *m = context;
+    struct psoc_sample sample;
+    unsigned long flags;
+    bool ok = m->message.status == 0;
+
+    spin_lock_irqsave(&psoc_acq.stats_lock, flags);
+    sample.ts_ns = ktime_get_ns();
+    sample.seq = psoc_acq.seq++;
+    if (ok)
+        psoc_acq.scans++;
+    else
+        psoc_acq.errors++;
+
+    for (int ch = 0; ok && ch < PSOC_CHANNELS; ch++) {
+        struct psoc_ring *ring = &psoc_acq.ring[ch];
+
+        sample.channel = ch;
+        sample.value = psoc_scan_sample(m, ch);
+        if (!kfifo_put(&ring->fifo, sample))
+            ring->overruns++;
+    }
+    spin_unlock_irqrestore(&psoc_acq.stats_lock, flags);
+
+    for (int ch = 0; ok && ch < PSOC_CHANNELS; ch++)
+        wake_up_interruptible(&psoc_acq.ring[ch].wait);
+
+    clear_bit_unlock(m - psoc_acq.slot, &psoc_acq.busy);
+    if (atomic_dec_and_test(&psoc_acq.inflight))
+        wake_up(&psoc_acq.idle);
+}
+
+static enum hrtimer_restart psoc_acq_tick(struct hrtimer *timer){
+    s64 late = ktime_to_ns(ktime_sub(ktime_get(), hrtimer_get_expires(timer)));
+    u64 period = div_u64(NSEC_PER_SEC, READ_ONCE(psoc_acq.rate_hz));
+    unsigned long flags;
+    u64 missed;
+    int slot;
+
+    /* Keep the grid, ticks that passed while we were late are timer overruns */
+    missed = hrtimer_forward_now(timer, ns_to_ktime(period)) - 1;
+
+    slot = find_first_zero_bit(&psoc_acq.busy, PSOC_ACQ_SLOTS);
+    if (slot < PSOC_ACQ_SLOTS) {
+        set_bit(slot, &psoc_acq.busy);
+        atomic_inc(&psoc_acq.inflight);
+        if (spi_async(psoc_acq.spi, &psoc_acq.slot[slot].message)) {
+            clear_bit(slot, &psoc_acq.busy);
+            atomic_dec(&psoc_acq.inflight);
+            slot = -1;
+        }
+    }
+
+    spin_lock_irqsave(&psoc_acq.stats_lock, flags);
+    psoc_acq.ticks += 1 + missed;
+    psoc_acq.timer_overruns += missed;
+    psoc_acq.bus_overruns += slot >= PSOC_ACQ_SLOTS;
+    psoc_acq.errors += slot < 0;
+    late = late < 0 ? 0 : late;
+    psoc_acq.late_sum_ns += late;
+    if (late > psoc_acq.late_max_ns)
+        psoc_acq.late_max_ns = late;
+    spin_unlock_irqrestore(&psoc_acq.stats_lock, flags);
+
+    return HRTIMER_RESTART;
+}
+
+/* Start sampling PSoC_spi_device, called with psoc_acq.lock held */
+static int psoc_acq_start(void){
+    unsigned long flags;
+    int err = 0;
+
+    if (psoc_acq.running)
+        return 0;
+    if (!PSoC_spi_device)
+        return -ENODEV;
+
+    for (int i = 0; i < PSOC_ACQ_SLOTS; i++) {
+        struct psoc_scan_msg *m = &psoc_acq.slot[i];
+
+        m->tx = kzalloc(ALIGN(PSOC_SCAN_TX_LEN, dma_get_cache_alignment()), GFP_KERNEL);
+        m->rx = kzalloc(ALIGN(PSOC_SCAN_RX_LEN, dma_get_cache_alignment()), GFP_KERNEL);
+        if (!m->tx || !m->rx) {
+            err = -ENOMEM;
+            goto err_free;
+        }
+        psoc_scan_init(m, PSoC_spi_device);
+        m->message.complete = psoc_acq_complete;
+        m->message.context = m;
+    }
+
+    /* Fresh rings and statistics for every run, acq_stats may be reading */
+    spin_lock_irqsave(&psoc_acq.stats_lock, flags);
+    for (int ch = 0; ch < PSOC_CHANNELS; ch++) {
+        kfifo_reset(&psoc_acq.ring[ch].fifo);
+        psoc_acq.ring[ch].overruns = 0;
+    }
+    psoc_acq.ticks = psoc_acq.scans = psoc_acq.bus_overruns = psoc_acq.errors = 0;
+    psoc_acq.timer_overruns = 0;
+    psoc_acq.seq = 0;
+    psoc_acq.late_sum_ns = psoc_acq.late_max_ns = 0;
+    psoc_acq.start_ns = ktime_get_ns();
+    spin_unlock_irqrestore(&psoc_acq.stats_lock, flags);
+
+    psoc_acq.spi = PSoC_spi_device;
+    psoc_acq.busy = 0;
+    WRITE_ONCE(psoc_acq.running, true);
+    hrtimer_start(&psoc_acq.timer, ns_to_ktime(div_u64(NSEC_PER_SEC, psoc_acq.rate_hz)),
+                  HRTIMER_MODE_REL);
+    return 0;
+
+    err_free:
+    for (int i = 0; i < PSOC_ACQ_SLOTS; i++) {
+        kfree(psoc_acq.slot[i].tx);
+        kfree(psoc_acq.slot[i].rx);
+        psoc_acq.slot[i].tx = psoc_acq.slot[i].rx = NULL;
+    }
+    return err;
+}
+
+/* Stop the timer and wait for scans on the bus, called with psoc_acq.lock held */
+static void psoc_acq_stop_locked(void){
+    if (!psoc_acq.running)
+        return;
+
+    hrtimer_cancel(&psoc_acq.timer);
+    wait_event(psoc_acq.idle, atomic_read(&psoc_acq.inflight) == 0);
+    WRITE_ONCE(psoc_acq.running, false);
+
+    for (int i = 0; i < PSOC_ACQ_SLOTS; i++) {
+        kfree(psoc_acq.slot[i].tx);
+        kfree(psoc_acq.slot[i].rx);
+        psoc_acq.slot[i].tx = psoc_acq.slot[i].rx = NULL;
+    }
 
-     return err;
- }
- 
+    /* Blocked readers return end of file */
+    for (int ch = 0; ch < PSOC_CHANNELS; ch++)
+        wake_up_interruptible(&psoc_acq.ring[ch].wait);
+}
+
+/* read() while acquiring: whole struct psoc_sample records of the channel */
+static ssize_t psoc_acq_read(struct file *filep, char __user *ubuf, size_t count, int channel){
+    struct psoc_ring *ring = &psoc_acq.ring[channel];
+    unsigned int copied;
+    int err;
+
+    if (count < sizeof(struct psoc_sample))
+        return -EINVAL;
+
+    if (filep->f_flags & O_NONBLOCK) {
+        if (kfifo_is_empty(&ring->fifo))
+            return -EAGAIN;
+    } else {
+        err = wait_event_interruptible(ring->wait, !kfifo_is_empty(&ring->fifo) ||
+                                       !READ_ONCE(psoc_acq.running));
+        if (err)
+            return err;
+    }
+
+    mutex_lock(&ring->read_lock);
+    err = kfifo_to_user(&ring->fifo, ubuf, rounddown(count, sizeof(struct psoc_sample)),
+                        &copied);
+    mutex_unlock(&ring->read_lock);
+
+    return err ? err : copied;
+}
+
+static ssize_t acq_enable_show(struct class *cls, struct class_attribute *attr, char *buf){
+    return sprintf(buf, "%d\n", READ_ONCE(psoc_acq.running));
+}
+
+static ssize_t acq_enable_store(struct class *cls, struct class_attribute *attr,
+                                const char *buf, size_t count){
+    bool on;
+    int err = kstrtobool(buf, &on);
+
+    if (err)
+        return err;
+
+    mutex_lock(&psoc_acq.lock);
+    if (on)
+        err = psoc_acq_start();
+    else
+        psoc_acq_stop_locked();
+    mutex_unlock(&psoc_acq.lock);
+
+    return err ? err : count;
+}
+
+static ssize_t acq_rate_hz_show(struct class *cls, struct class_attribute *attr, char *buf){
+    return sprintf(buf, "%u\n", READ_ONCE(psoc_acq.rate_hz));
+}
+
+/* Takes effect at the next tick */
+static ssize_t acq_rate_hz_store(struct class *cls, struct class_attribute *attr,
+                                 const char *buf, size_t count){
+    unsigned int hz;
+    int err = kstrtouint(buf, 0, &hz);
+
+    if (err)
+        return err;
+    if (hz == 0 || hz > PSOC_ACQ_MAX_HZ)
+        return -EINVAL;
+
+    WRITE_ONCE(psoc_acq.rate_hz, hz);
+    return count;
+}
+
+/* Achieved rate is in milli-Hertz, lateness is of the timer ticks */
+static ssize_t acq_stats_show(struct class *cls, struct class_attribute *attr, char *buf){
+    u64 ticks, scans, bus_overruns, timer_overruns, errors, late_sum, late_max;
+    u64 overruns[PSOC_CHANNELS];
+    unsigned long flags;
+    u64 start, elapsed;
+    int len;
+
+    spin_lock_irqsave(&psoc_acq.stats_lock, flags);
+    start = psoc_acq.start_ns;
+    ticks = psoc_acq.ticks;
+    scans = psoc_acq.scans;
+    bus_overruns = psoc_acq.bus_overruns;
+    timer_overruns = psoc_acq.timer_overruns;
+    errors = psoc_acq.errors;
+    late_sum = psoc_acq.late_sum_ns;
+    late_max = psoc_acq.late_max_ns;
+    for (int ch = 0; ch < PSOC_CHANNELS; ch++)
+        overruns[ch] = psoc_acq.ring[ch].overruns;
+    spin_unlock_irqrestore(&psoc_acq.stats_lock, flags);
+
+    elapsed = ktime_get_ns() - start;
+
+    len = sprintf(buf, "ticks %llu scans %llu achieved_mhz %llu bus_overruns %llu "
+                  "timer_overruns %llu errors %llu\n",
+                  ticks, scans, elapsed ? div64_u64(scans * 1000 * NSEC_PER_SEC, elapsed) : 0,
+                  bus_overruns, timer_overruns, errors);
+    len += sprintf(buf + len, "late_avg_ns %llu late_max_ns %llu\n",
+                   ticks ? div64_u64(late_sum, ticks) : 0, late_max);
+    for (int ch = 0; ch < PSOC_CHANNELS; ch++)
+        len += sprintf(buf + len, "%s_overruns %llu\n", subdev_names[ch], overruns[ch]);
+
+    return len;
+}
+
+static CLASS_ATTR_RW(acq_enable);
+static CLASS_ATTR_RW(acq_rate_hz);
+static CLASS_ATTR_RO(acq_stats);
+
+static int psoc_acq_sysfs_add(struct class *cls){
+    int err;
+
+    err = class_create_file(cls, &class_attr_acq_enable);
+    if (err)
+        return err;
+    err = class_create_file(cls, &class_attr_acq_rate_hz);
+    if (err)
+        goto err_enable;
+    err = class_create_file(cls, &class_attr_acq_stats);
+    if (err)
+        goto err_rate;
+    return 0;
+
+    err_rate:
+    class_remove_file(cls, &class_attr_acq_rate_hz);
+    err_enable:
+    class_remove_file(cls, &class_attr_acq_enable);
+    return err;
+}
+
+static void psoc_acq_sysfs_del(struct class *cls){
+    class_remove_file(cls, &class_attr_acq_stats);
+    class_remove_file(cls, &class_attr_acq_rate_hz);
+    class_remove_file(cls, &class_attr_acq_enable);
+}
+
+/*
+ * Character Driver Read File Operations Method
+ */
 ssize_t spi_drv_read(struct file *filep, char __user *ubuf,
                      size_t count, loff_t *f_pos)
 {
-    int minor, len;
+    struct psoc_dev *st = filep->private_data;
+    int minor, len, err;
     char resultBuf[MAXLEN];
-    s16 result=1234;
+    s16 result;
 
     minor = iminor(filep->f_inode);
 
-    /*
-    Provide a result to write to user space
-    */
-
-    psoc_read_byte(PSoC_spi_device, resultBuf);
-
-    if(MODULE_DEBUG)
-        printk(KERN_ALERT "%s-%i read: %i\n",
-
-    spi_devs[minor].spi->modalias, spi_devs[minor].channel, result);
+    /* Binary records from the ring while continuous acquisition runs */
+    if (READ_ONCE(psoc_acq.running))
+        return psoc_acq_read(filep, ubuf, count, spi_devs[minor].channel);
+
+    /* Sample the minor's channel, from the last scan if recent enough */
+    if (!psoc_dev_enter(st))
+        return -ENODEV;
+    err = psoc_read_cached(st->spi, spi_devs[minor].channel, &result);
+    if (!err)
+        dev_dbg(&st->spi->dev, "%s-%i read: %i\n",
+                st->spi->modalias, spi_devs[minor].channel, result);
+    psoc_dev_exit(st);
+    if (err)
+        return err;
 
-    /* Convert integer to string limited to "count" size. Returns
-    * length excluding NULL termination */
-    len = snprintf(resultBuf, count, "%d\n", result);
+    /* Convert integer to string. Returns length excluding NULL termination */
+    len = snprintf(resultBuf, sizeof(resultBuf), "%d\n", result);
 
-    /* Append Length of NULL termination */
+    /* Append Length of NULL termination, but never copy more than count */
     len++;
+    len = min_t(size_t, len, count);
 
     /* Copy data to user space */
     if(copy_to_user(ubuf, resultBuf, len))
@@ -239,15 +814,223 @@ ssize_t spi_drv_read(struct file *filep, char __user *ubuf,
     return len;
 }
 
+/*
+ * Character Driver Ioctl File Operations Method
+ * PSOC_IOC_XFER: raw transfer through the DMA safe buffers
+ */
+static long spi_drv_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+    struct psoc_dev *st = filep->private_data;
+    struct psoc_xfer x;
+    int err;
+
+    if (cmd != PSOC_IOC_XFER)
+        return -ENOTTY;
+
+    if (copy_from_user(&x, (void __user *)arg, sizeof(x)))
+        return -EFAULT;
+    if (x.len == 0 || x.len > PSOC_XFER_MAX)
+        return -EINVAL;
+
+    if (!psoc_dev_enter(st))
+        return -ENODEV;
+    mutex_lock(&st->lock);
+    if (!x.tx_buf)
+        memset(st->tx, 0, x.len);
+    else if (copy_from_user(st->tx, u64_to_user_ptr(x.tx_buf), x.len)) {
+        err = -EFAULT;
+        goto out_unlock;
+    }
+
+    err = psoc_xfer_locked(st->spi, st, x.len, x.rx_buf != 0, x.speed_hz);
+    if (!err && x.rx_buf && copy_to_user(u64_to_user_ptr(x.rx_buf), st->rx, x.len))
+        err = -EFAULT;
+
+    out_unlock:
+    mutex_unlock(&st->lock);
+    psoc_dev_exit(st);
+    return err;
+}
+
+/*
+ * Character Driver Open/Release: a file keeps the state of the device
+ * it was opened on, see struct psoc_dev
+ */
+static int spi_drv_open(struct inode *inode, struct file *filep){
+    struct psoc_dev *st = NULL;
+    int minor = iminor(inode);
+
+    mutex_lock(&spi_devs_lock);
+    if (minor < spi_devs_cnt) {
+        st = spi_get_drvdata(spi_devs[minor].spi);
+        kref_get(&st->ref);
+    }
+    mutex_unlock(&spi_devs_lock);
+
+    if (!st)
+        return -ENODEV;
+    filep->private_data = st;
+    return 0;
+}
+
+static int spi_drv_release(struct inode *inode, struct file *filep){
+    psoc_dev_put(filep->private_data);
+    return 0;
+}
+
 /*
  * Character Driver File Operations Structure
  */
 struct file_operations spi_drv_fops ={
     .owner   = THIS_MODULE,
+    .open    = spi_drv_open,
+    .release = spi_drv_release,
     .write   = spi_drv_write,
     .read    = spi_drv_read,
+    .unlocked_ioctl = spi_drv_ioctl,
 };
 
+/**********************************************************
+ * IIO FRONT-END
+ **********************************************************/
+
+/*
+ * The PSoC channels as IIO device "psoc", next to the char devices:
+ * in_<type>_raw/_scale/_offset per channel and a triggered buffer, so
+ * iio_readdev/libiio and any IIO trigger (hrtimer, sysfs) work. Every
+ * trigger does one psoc_scan() of all channels; the IIO core picks the
+ * enabled channels out of it. Scales convert the PSoC firmware units to
+ * IIO units, offsets are writable for calibration.
+ */
+struct psoc_iio {
+    struct spi_device *spi;
+    int offset[PSOC_CHANNELS];
+    struct {
+        s16 samples[PSOC_CHANNELS];
+        s64 ts __aligned(8);
+    } scan;
+};
+
+/* IIO unit per PSoC unit, as numerator/denominator */
+static const int psoc_iio_scale[][2] = {
+    { 1, 100 },     /* ph: centi-pH -> pH */
+    { 1, 1000 },    /* wl: mm -> m */
+    { 1, 1 },       /* sl: lux */
+    { 100, 1 },     /* ms: 0.1 % -> milli percent */
+};
+
+#define PSOC_IIO_CHAN(_type, _ch) {                                     \
+    .type = _type,                                                      \
+    .address = _ch,                                                     \
+    .info_mask_separate = BIT(IIO_CHAN_INFO_RAW) |                      \
+                          BIT(IIO_CHAN_INFO_SCALE) |                    \
+                          BIT(IIO_CHAN_INFO_OFFSET),                    \
+    .scan_index = _ch,                                                  \
+    .scan_type = {                                                      \
+        .sign = 's',                                                    \
+        .realbits = 16,                                                 \
+        .storagebits = 16,                                              \
+        .endianness = IIO_CPU,                                          \
+    },                                                                  \
+}
+
+static const struct iio_chan_spec psoc_iio_channels[] = {
+    PSOC_IIO_CHAN(IIO_PH, 0),
+    PSOC_IIO_CHAN(IIO_DISTANCE, 1),
+    PSOC_IIO_CHAN(IIO_LIGHT, 2),
+    PSOC_IIO_CHAN(IIO_HUMIDITYRELATIVE, 3),
+    IIO_CHAN_SOFT_TIMESTAMP(4),
+};
+
+/* Every scan reads all channels */
+static const unsigned long psoc_iio_scan_masks[] = { GENMASK(3, 0), 0 };
+
+static int psoc_iio_read_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+                             int *val, int *val2, long mask){
+    struct psoc_iio *st = iio_priv(indio_dev);
+    int err;
+    s16 sample;
+
+    switch (mask) {
+    case IIO_CHAN_INFO_RAW:
+        /* The buffer owns the bus while it runs */
+        err = iio_device_claim_direct_mode(indio_dev);
+        if (err)
+            return err;
+        err = psoc_read_channel(st->spi, chan->address, &sample);
+        iio_device_release_direct_mode(indio_dev);
+        if (err)
+            return err;
+        *val = sample;
+        return IIO_VAL_INT;
+    case IIO_CHAN_INFO_SCALE:
+        *val = psoc_iio_scale[chan->address][0];
+        *val2 = psoc_iio_scale[chan->address][1];
+        return IIO_VAL_FRACTIONAL;
+    case IIO_CHAN_INFO_OFFSET:
+        *val = READ_ONCE(st->offset[chan->address]);
+        return IIO_VAL_INT;
+    default:
+        return -EINVAL;
+    }
+}
+
+static int psoc_iio_write_raw(struct iio_dev *indio_dev, struct iio_chan_spec const *chan,
+                              int val, int val2, long mask){
+    struct psoc_iio *st = iio_priv(indio_dev);
+
+    if (mask != IIO_CHAN_INFO_OFFSET || val2)
+        return -EINVAL;
+
+    WRITE_ONCE(st->offset[chan->address], val);
+    return 0;
+}
+
+static const struct iio_info psoc_iio_info = {
+    .read_raw = psoc_iio_read_raw,
+    .write_raw = psoc_iio_write_raw,
+};
+
+static irqreturn_t psoc_iio_trigger_handler(int irq, void *p){
+    struct iio_poll_func *pf = p;
+    struct iio_dev *indio_dev = pf->indio_dev;
+    struct psoc_iio *st = iio_priv(indio_dev);
+
+    if (!psoc_scan(st->spi, st->scan.samples))
+        iio_push_to_buffers_with_timestamp(indio_dev, &st->scan, pf->timestamp);
+
+    iio_trigger_notify_done(indio_dev->trig);
+    return IRQ_HANDLED;
+}
+
+/* Register the IIO device, device managed so it goes with the SPI device */
+static int psoc_iio_register(struct spi_device *sdev){
+    struct iio_dev *indio_dev;
+    struct psoc_iio *st;
+    int err;
+
+    indio_dev = devm_iio_device_alloc(&sdev->dev, sizeof(*st));
+    if (!indio_dev)
+        return -ENOMEM;
+
+    st = iio_priv(indio_dev);
+    st->spi = sdev;
+
+    indio_dev->dev.parent = &sdev->dev;
+    indio_dev->name = "psoc";
+    indio_dev->modes = INDIO_DIRECT_MODE;
+    indio_dev->info = &psoc_iio_info;
+    indio_dev->channels = psoc_iio_channels;
+    indio_dev->num_channels = ARRAY_SIZE(psoc_iio_channels);
+    indio_dev->available_scan_masks = psoc_iio_scan_masks;
+
+    err = devm_iio_triggered_buffer_setup(&sdev->dev, indio_dev, iio_pollfunc_store_time,
+                                          psoc_iio_trigger_handler, NULL);
+    if (err)
+        return err;
+
+    return devm_iio_device_register(&sdev->dev, indio_dev);
+}
+
 /**********************************************************
  * LINUX DEVICE MODEL METHODS (spi)
  **********************************************************/
@@ -255,26 +1038,65 @@ struct file_operations spi_drv_fops ={
 /*
  * spi_drv Probe
  * Called when a device with the name "spi_drv" is
- * registered.
+ * registered. Runs asynchronously (PROBE_PREFER_ASYNCHRONOUS),
+ * errors from spi_setup (incl. -EPROBE_DEFER) are passed on
+ * before any node is created.
  */
 static int spi_drv_probe(struct spi_device *sdev){
 
     int err = 0;
     struct device *spi_drv_device;
+    u64 start = ktime_get_ns();
 
-    printk(KERN_DEBUG "New SPI device: %s using chip select: %i\n",
+    dev_dbg(&sdev->dev, "New SPI device: %s using chip select: %i\n",
          sdev->modalias, sdev->chip_select);
 
     /* Check we are not creating more
-     devices than we have space for */
-    if (spi_devs_cnt > spi_devs_len) {
+     devices than we have space for (one per channel) */
+    if (spi_devs_cnt + ARRAY_SIZE(subdev_names) > spi_devs_len) {
     printk(KERN_ERR "Too many SPI devices for driver\n");
     return -ENODEV;
     }
 
     /* Configure bits_per_word, always 8-bit for RPI!!! */
     sdev->bits_per_word = 8;
-    spi_setup(sdev);
+    err = spi_setup(sdev);
+    if (err) {
+        if (err != -EPROBE_DEFER)
+            dev_err(&sdev->dev, "spi_setup failed: %d\n", err);
+        return err;
+    }
+
+    /* DMA safe buffers and the prebuilt messages using them */
+    struct psoc_dev *st = kzalloc(sizeof(*st), GFP_KERNEL);
+    if (!st)
+        return -ENOMEM;
+
+    st->spi = sdev;
+    kref_init(&st->ref);
+    init_rwsem(&st->gone_lock);
+    mutex_init(&st->lock);
+    st->tx = psoc_dma_alloc(PSOC_XFER_MAX);
+    st->rx = psoc_dma_alloc(PSOC_XFER_MAX);
+    st->scan.tx = psoc_dma_alloc(PSOC_SCAN_TX_LEN);
+    st->scan.rx = psoc_dma_alloc(PSOC_SCAN_RX_LEN);
+
+    /* Drops probe's reference on a probe error below, and on remove */
+    err = devm_add_action_or_reset(&sdev->dev, psoc_dev_put, st);
+    if (err)
+        return err;
+    if (!st->tx || !st->rx || !st->scan.tx || !st->scan.rx)
+        return -ENOMEM;
+
+    psoc_read_init(st, sdev);
+    psoc_scan_init(&st->scan, sdev);
+
+    spi_message_init(&st->bulk_msg);
+    st->bulk_msg.spi = sdev;
+    st->bulk_t.tx_buf = st->tx;
+    spi_message_add_tail(&st->bulk_t, &st->bulk_msg);
+
+    spi_set_drvdata(sdev, st);
 
     /* Create devices, populate sysfs and
      active udev to create devices in /dev */
@@ -286,19 +1108,31 @@ static int spi_drv_probe(struct spi_device *sdev){
                                      MKDEV(MAJOR(devno), spi_devs_cnt),
                                      NULL, "spi_drv%d-%s", spi_devs_cnt, subdev_names[i]);
         if (IS_ERR(spi_drv_device)){
-            printk(KERN_ALERT "FAILED TO CREATE DEVICE\n");
+            dev_err(&sdev->dev, "Failed to create device %s\n", subdev_names[i]);
         } else{
-            printk(KERN_ALERT "Using spi_devs%i on major:%i, minor:%i\n",
+            dev_dbg(&sdev->dev, "Using spi_devs%i on major:%i, minor:%i\n",
             spi_devs_cnt, MAJOR(devno), spi_devs_cnt);
         }
 
         int channelnumber = i;
 
         /* Update local array of SPI devices */
+        mutex_lock(&spi_devs_lock);
         spi_devs[spi_devs_cnt].spi = sdev;
         spi_devs[spi_devs_cnt].channel = channelnumber; // channel address 0x00
         ++spi_devs_cnt;
+        mutex_unlock(&spi_devs_lock);
     }
+
+    /* IIO device, the char devices above stay for compatibility */
+    err = psoc_iio_register(sdev);
+    if (err) {
+        dev_err(&sdev->dev, "Failed to register IIO device: %d\n", err);
+        err = 0; /* The char devices work without it */
+    }
+
+    dev_info(&sdev->dev, "probed in %llu us\n",
+             div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
     return err;
 }
 
@@ -308,13 +1142,29 @@ static int spi_drv_probe(struct spi_device *sdev){
  * Can deallocate data if needed
  */
 static int spi_drv_remove(struct spi_device *sdev){
+    struct psoc_dev *st = spi_get_drvdata(sdev);
+
+    dev_dbg(&sdev->dev, "Removing spi device\n");
 
-    printk (KERN_ALERT "Removing spi device\n");
+    /* No scans may reach the device after remove */
+    mutex_lock(&psoc_acq.lock);
+    psoc_acq_stop_locked();
+    PSoC_spi_device = NULL;
+    mutex_unlock(&psoc_acq.lock);
 
     /* Destroy devices created in probe() */
     for(int i = 0; i < spi_devs_len; i++){
         device_destroy(spi_drv_class, MKDEV(MAJOR(devno), i));
     }
+    mutex_lock(&spi_devs_lock);
+    spi_devs_cnt = 0;
+    mutex_unlock(&spi_devs_lock);
+    psoc_snap.ts_ns = 0; // the next device starts with a fresh scan
+
+    /* Open files get -ENODEV from now on, wait for the ones in flight */
+    down_write(&st->gone_lock);
+    st->gone = true;
+    up_write(&st->gone_lock);
 
     return 0;
 }
@@ -328,14 +1178,22 @@ static const struct of_device_id of_spi_drv_spi_device_match[] = {
   { .compatible = "ase, spi_drv", }, {},
 };
 
+/* Matches devices registered without DT, e.g. by psoc_mock */
+static const struct spi_device_id spi_drv_spi_id[] = {
+  { "spi_drv", 0 }, {},
+};
+MODULE_DEVICE_TABLE(spi, spi_drv_spi_id);
+
 static struct spi_driver spi_drv_spi_driver = {
   .probe      = spi_drv_probe,
   .remove     = spi_drv_remove,
+  .id_table   = spi_drv_spi_id,
   .driver     = {
     .name   = "spi_drv",
     .bus    = &spi_bus_type,
     .of_match_table = of_spi_drv_spi_device_match,
     .owner  = THIS_MODULE,
+    .probe_type = PROBE_PREFER_ASYNCHRONOUS,
   },
 };
 
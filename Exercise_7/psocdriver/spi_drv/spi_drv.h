@@ -0,0 +1,35 @@
+#ifndef SPI_DRV_H
+#define SPI_DRV_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Binary record returned by read() on /dev/spi_drvN-xx while continuous
+ * acquisition runs (echo 1 > /sys/class/spi_drv_class/acq_enable), one
+ * per scan of the channel.
+ */
+struct psoc_sample {
+    __u64 ts_ns;    // CLOCK_MONOTONIC time the scan completed
+    __u32 seq;      // scan number since start, a gap means samples were dropped
+    __u16 channel;
+    __s16 value;
+};
+
+/*
+ * Raw full duplex transfer of up to PSOC_XFER_MAX bytes on the PSoC's
+ * chip select, through the driver's DMA safe buffers. Any minor will do.
+ */
+#define PSOC_XFER_MAX 4096
+
+struct psoc_xfer {
+    __u64 tx_buf;   // user pointer to len bytes to send, 0 sends zeros
+    __u64 rx_buf;   // user pointer for len received bytes, 0 discards them
+    __u32 len;
+    __u32 speed_hz; // 0: the device's max speed
+};
+
+#define PSOC_IOC_MAGIC 'P'
+#define PSOC_IOC_XFER _IOWR(PSOC_IOC_MAGIC, 1, struct psoc_xfer)
+
+#endif
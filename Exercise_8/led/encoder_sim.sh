@@ -0,0 +1,55 @@
+#!/bin/sh
+#
+# Turns a simulated rotary encoder and checks the position plat_drv decodes.
+#
+#   encoder_sim.sh <gpio-sim chip dir> <offset A> <offset B> <plat_drv dev dir> [cycles]
+#
+# The two gpio-sim lines must be the encoder-lines of plat_drv, e.g. with a
+# "gpio-simulator" node in the overlay instead of &gpio. Example:
+#   encoder_sim.sh /sys/devices/platform/gpio-sim.0/gpiochip2 0 1 /sys/class/gpio_class/gpio101
+#
+# Every cycle is 4 steps forward, then the same number of cycles backwards,
+# so the position must return to where it started and errors must not move.
+
+SIM=$1
+A=$2
+B=$3
+DEV=$4
+CYCLES=${5:-100}
+
+if [ -z "$DEV" ]; then
+  echo "Usage: $0 sim_chip_dir offset_a offset_b plat_drv_dev_dir [cycles]"
+  exit 1
+fi
+
+set_lines(){
+  echo "$1" > "$SIM/sim_gpio$A/pull"
+  echo "$2" > "$SIM/sim_gpio$B/pull"
+}
+
+set_lines pull-down pull-down
+sleep 0.1
+echo 0 > "$DEV/position"
+err0=$(cat "$DEV/encoder_errors")
+
+i=0
+while [ $i -lt "$CYCLES" ]; do
+  for ab in "pull-down pull-up" "pull-up pull-up" "pull-up pull-down" "pull-down pull-down"; do
+    set_lines $ab
+  done
+  i=$((i + 1))
+done
+fwd=$(cat "$DEV/position")
+
+i=0
+while [ $i -lt "$CYCLES" ]; do
+  for ab in "pull-up pull-down" "pull-up pull-up" "pull-down pull-up" "pull-down pull-down"; do
+    set_lines $ab
+  done
+  i=$((i + 1))
+done
+back=$(cat "$DEV/position")
+err=$(( $(cat "$DEV/encoder_errors") - err0 ))
+
+echo "forward: $fwd (expected $((CYCLES * 4))), back: $back (expected 0), errors: $err"
+[ "$fwd" -eq $((CYCLES * 4)) ] && [ "$back" -eq 0 ] && [ "$err" -eq 0 ]
@@ -0,0 +1,131 @@
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <sys/ioctl.h>
+
+#include "plat_drv.h"
+
+/*
+ * Per-line versus bank access to the lines of plat_drv.
+ *
+ *   plat_bench [-n lines] [-i iterations] [-w]
+ *
+ * A per-line sample reads /dev/gpio101 ... /dev/gpio(100+n), one syscall and
+ * one sprintf per line, each line sampled at a different instant. A bank
+ * sample is a single read of /dev/gpiobank0. Both are then repeated through
+ * the binary PLAT_IOC_GET ioctl, which skips the sprintf/sscanf. With -w the
+ * lines are written instead, toggling between all zeros and all ones
+ * (PLAT_IOC_SET for the ioctl runs).
+ *
+ * Against gpio-sim, point the overlay's gpios at the simulated chip.
+ */
+
+#define MAX_LINES 32
+#define DEFAULT_ITERATIONS 100000
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void report(const char *name, long iterations, long syscalls, double secs){
+  printf("%-15s %ld samples in %.3f s: %.0f ns/sample, %.0f samples/s, %.0f ops/s\n",
+         name, iterations, secs, secs * 1e9 / iterations, iterations / secs, syscalls / secs);
+}
+
+int main(int argc, char *argv[]){
+  long iterations = DEFAULT_ITERATIONS;
+  int nlines = 2;
+  int wr = 0;
+  int fds[MAX_LINES];
+  char buf[32], path[32];
+  int opt;
+
+  while((opt = getopt(argc, argv, "n:i:w")) != -1){
+    switch(opt){
+      case 'n':
+        nlines = atoi(optarg);
+        break;
+      case 'i':
+        iterations = atol(optarg);
+        break;
+      case 'w':
+        wr = 1;
+        break;
+      default:
+        printf("Usage: %s [-n lines] [-i iterations] [-w]\n", argv[0]);
+        return -1;
+    }
+  }
+  if(nlines < 1 || nlines > MAX_LINES){
+    printf("1 to %d lines\n", MAX_LINES);
+    return -1;
+  }
+
+  for(int i = 0; i < nlines; i++){
+    snprintf(path, sizeof(path), "/dev/gpio%d", 101 + i);
+    fds[i] = open(path, wr ? O_WRONLY : O_RDONLY);
+    if(fds[i] < 0){
+      printf("Error opening %s: %s \n", path, strerror(errno));
+      return -1;
+    }
+  }
+  int bank = open("/dev/gpiobank0", wr ? O_WRONLY : O_RDONLY);
+  if(bank < 0){
+    printf("Error opening /dev/gpiobank0: %s \n", strerror(errno));
+    return -1;
+  }
+
+  double start = now();
+  for(long i = 0; i < iterations; i++){
+    for(int j = 0; j < nlines; j++){
+      if(wr){
+        write(fds[j], (i & 1) ? "0" : "1", 1);
+      } else {
+        pread(fds[j], buf, sizeof(buf), 0);
+      }
+    }
+  }
+  report("per-line text", iterations, iterations * nlines, now() - start);
+
+  char ones[16];
+  snprintf(ones, sizeof(ones), "0x%x", (unsigned)((1ULL << nlines) - 1));
+  start = now();
+  for(long i = 0; i < iterations; i++){
+    if(wr){
+      write(bank, (i & 1) ? "0" : ones, (i & 1) ? 1 : strlen(ones));
+    } else {
+      pread(bank, buf, sizeof(buf), 0);
+    }
+  }
+  report("bank text", iterations, iterations, now() - start);
+
+  struct plat_gpio_value v;
+  start = now();
+  for(long i = 0; i < iterations; i++){
+    v.value = (i & 1) ? 0 : 1;
+    for(int j = 0; j < nlines; j++){
+      ioctl(fds[j], wr ? PLAT_IOC_SET : PLAT_IOC_GET, &v);
+    }
+  }
+  report("per-line ioctl", iterations, iterations * nlines, now() - start);
+
+  start = now();
+  for(long i = 0; i < iterations; i++){
+    v.value = (i & 1) ? 0 : (1ULL << nlines) - 1;
+    ioctl(bank, wr ? PLAT_IOC_SET : PLAT_IOC_GET, &v);
+  }
+  report("bank ioctl", iterations, iterations, now() - start);
+
+  for(int i = 0; i < nlines; i++){
+    close(fds[i]);
+  }
+  close(bank);
+  return 0;
+}
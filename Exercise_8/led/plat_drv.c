@@ -8,85 +8,554 @@
 #include <linux/err.h>
 #include <linux/of_gpio.h>
 #include <linux/kernel.h>
+#include <linux/interrupt.h>
+#include <linux/wait.h>
+#include <linux/poll.h>
+#include <linux/slab.h>
+#include <linux/atomic.h>
+#include <linux/hrtimer.h>
+#include <linux/ktime.h>
+#include <linux/math64.h>
+#include <linux/spinlock.h>
+#include <linux/mutex.h>
+#include <linux/of.h>
+#include <linux/gpio/consumer.h>
+#include <linux/version.h>
+#include <linux/idr.h>
+#include <linux/debugfs.h>
+#include <linux/seq_file.h>
+#include <linux/log2.h>
+#include <linux/workqueue.h>
+#include <linux/sysfs.h>
+#include <linux/kernfs.h>
+#include <linux/kref.h>
+#include <linux/rwsem.h>
+
+#include "plat_drv.h"
+
+#define CREATE_TRACE_POINTS
+#include "plat_drv_trace.h"
 
 MODULE_LICENSE("GPL");
 MODULE_AUTHOR("Rene Street");
 MODULE_DESCRIPTION("GPIO device driver for fHAT");
 
+/*
+ * Every platform device (fHAT board) gets its own gpio_pdata, sized by the
+ * number of lines in its gpios property. Each line and the bank have their
+ * own cdev on a minor taken from gpio_minors, so only minors of lines that
+ * exist are in use. The region below is just the range they come from.
+ *
+ * Open files can outlive the platform device (unbind, module of the GPIO
+ * controller going away), so gpio_pdata is not devm memory: it is freed on
+ * the last put of its kref, which probe holds until the devm resources are
+ * gone and every open file holds until release. gpio_nodes maps a minor to
+ * its line or bank while the node exists, open looks it up and takes its
+ * reference under gpio_nodes_lock, so it cannot race with remove. The cdevs
+ * come from cdev_alloc() and are freed by their kobject, which the VFS
+ * still uses after release returns.
+ */
+#define GPIO_MINORS 256
+#define GPIO_MAX_DEVICES 8
+
 static dev_t devno;
+static DEFINE_IDA(gpio_minors);
+static DEFINE_IDA(gpio_ids); // instance numbers, for node names
+static DEFINE_MUTEX(gpio_nodes_lock);
+static void *gpio_nodes[GPIO_MINORS]; // gpio_dev or, for a bank, gpio_pdata
 
-static struct cdev gpio_cdev;
 struct file_operations gpio_fops;
+static const struct file_operations gpio_bank_fops;
 
 static struct platform_driver gpio_platform_driver;
 static struct class *gpio_class;
-static struct device *gpio_device_101;
+
+struct gpio_encoder;
+struct gpio_pdata;
+
+/*
+ * Operation counters and log2 latency histograms (bucket b: 2^b..2^(b+1) ns
+ * spent in the driver) of one node, in debugfs as plat_drv/<node name>.
+ */
+enum gpio_op { GPIO_OP_OPEN, GPIO_OP_READ, GPIO_OP_WRITE, GPIO_OP_IOCTL, GPIO_OP_NR };
+#define GPIO_HIST_BUCKETS 32
+
+struct gpio_stats{
+    atomic_long_t count[GPIO_OP_NR];
+    atomic_long_t hist[GPIO_OP_NR][GPIO_HIST_BUCKETS];
+};
+
+static struct dentry *gpio_debugfs;
 
 struct gpio_dev{
+    struct gpio_pdata *pd; // platform device the line belongs to
+    int line; // index in the gpios property, bit in the bank
+    int minor; // -1 until the node exists
+    struct cdev *cdev;
+    struct gpio_stats stats;
+    struct dentry *debugfs;
     int no; // GPIO number
     int dir; // 0: in, 1: out
 	u8 value;
+    int irq; // edge interrupt of an input line, 0 if none
+    atomic_t events; // edges seen on the line
+    struct kernfs_node *value_kn; // sysfs value, notified on every edge
+    wait_queue_head_t wait;
+    struct fasync_struct *async_queue;
+
+    /*
+     * Counter mode (gate_ms != 0): the IRQ only counts and a gate timer
+     * publishes edges, period and frequency once per gate, which is also
+     * the only time readers are woken.
+     */
+    unsigned int gate_ms;
+    struct hrtimer gate_timer;
+    spinlock_t lock; // gate state below
+    u32 gate_edges;
+    u64 gate_first_ts;
+    u64 gate_last_ts;
+    u64 count_total; // edges since counter mode was enabled
+    u32 count_edges; // edges in the last complete gate
+    u64 period_ns; // mean signal period in the last gate, 0 if unknown
+    atomic_t gates; // completed gates
+
+    struct gpio_encoder *enc; // set on both lines of an encoder pair
+
+    /* PWM of an output line, see struct gpio_pwm */
+    u64 pwm_period_ns;
+    u64 pwm_duty_ns;
+    u64 pwm_phase_ns; // rising edge offset from the engine epoch
 };
 
-static struct gpio_dev gpio_devs[255];
-static int gpios_len = 255;
+/*
+ * Quadrature decoder on two input lines, enabled by listing their indices
+ * in the gpios property as encoder-lines = <A B>; in the device tree.
+ * Both lines interrupt on both edges and every edge re-reads A and B, so
+ * the position moves one step per edge (4 per encoder cycle). A transition
+ * where both lines changed means an edge was missed; it is counted in
+ * errors and does not move the position.
+ */
+struct gpio_encoder{
+    struct gpio_dev *a, *b;
+    struct mutex lock; // decoder state
+    u8 state; // (A << 1) | B at the last edge
+    atomic64_t position; // steps, 64 bit reads never tear
+    atomic_t errors;
+
+    /* Velocity in steps/s, sampled every velocity_ms (0: off) */
+    unsigned int velocity_ms;
+    struct hrtimer velocity_timer;
+    s64 last_position;
+    atomic64_t velocity;
+};
 
-static u8 toggle_state = 0;
+/*
+ * Bank node: all lines of the platform device as one bitmask, bit i being
+ * line i of the gpios property. One read or write is one gpiod array call,
+ * so inputs are sampled together and outputs change together (per chip).
+ * Values are raw, like the per-line nodes: the DT flag cell is used as the
+ * direction here, not as active-low.
+ *
+ * Output writes from every node go through a shadow word of the requested
+ * levels, changed with one atomic op per request (set/clear/toggle mask)
+ * and never read back from the hardware. Writers of different lines thus
+ * never lock or disturb each other.
+ */
+#define GPIO_BANK_MAX 32
+
+struct gpio_bank{
+    struct gpio_descs *descs; // every line, in DT order
+    unsigned long out_mask; // bank bits of the output lines
+    atomic_long_t shadow; // requested output levels
+    bool cansleep; // an output sits on a controller that may sleep
+};
 
-/* "Set"-function for attributes */
+/*
+ * PWM engine of a platform device, set up through the pwm/ attributes of
+ * each output line. All enabled lines share one hrtimer and one time base:
+ * a line is high for duty_ns from epoch + phase + k * period_ns. Every
+ * expiry works out the level of each line from the current time, writes
+ * them in one bank update and sleeps until the nearest next edge, so edges
+ * due at the same time change together and lateness never accumulates.
+ * On controllers that may sleep the lines are written from a work item.
+ */
+#define GPIO_PWM_MIN_PERIOD_NS 10000
+
+struct gpio_pwm{
+    struct mutex lock; // settings only change with the engine stopped
+    struct hrtimer timer;
+    struct work_struct work;
+    ktime_t epoch; // set when the first line is enabled
+    unsigned long running; // bank bits of the enabled lines
+    unsigned long levels; // computed by the timer, for the work item
+};
 
-static ssize_t gpio_toggle_state_store(struct device* dev,
-    struct device_attribute* attr, const char* buf, size_t size){
+/* One per platform device */
+struct gpio_pdata{
+    int id;
+    struct kref ref; // probe and every open file
+    struct rw_semaphore gone_lock; // held for reading around hardware access
+    bool gone; // removed: open files get -ENODEV
+    struct gpio_bank bank;
+    struct cdev *bank_cdev;
+    int bank_minor; // -1 until the node exists
+    struct gpio_stats bank_stats;
+    struct dentry *bank_debugfs;
+    struct gpio_encoder enc; // enc.a is NULL without encoder-lines
+    struct gpio_pwm pwm;
+    int ngpios;
+    struct gpio_dev gpios[];
+};
 
-	u8 value;
-    int err = kstrtou8(buf, 0, &value);
-	if(err < 0){
-		printk(KERN_ALERT "Unable to parse string\n");
-		return err;
-	}
+/* Position change per transition, indexed by (old state << 2) | new state. 2: invalid */
+static const s8 gpio_quad_table[16] = {
+     0, +1, -1,  2,
+    -1,  0,  2, +1,
+    +1,  2,  0, -1,
+     2, -1, +1,  0,
+};
 
-	toggle_state = value;
+/* Per open file state, remembers the last edge the reader has seen */
+struct gpio_file{
+    struct gpio_dev *gdev;
+    int seen;
+    int gates_seen; // counter mode
+};
+
+/* Counter mode attributes, per line (drvdata is the gpio_dev) */
 
-	printk("Store called with %i\n", value);
+static ssize_t gate_ms_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
 
-	return size;
+    return sprintf(buf, "%u\n", gdev->gate_ms);
 }
 
-/* "Get"-function for attributes */
+static ssize_t gate_ms_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
 
-static ssize_t gpio_toggle_state_show(struct device *dev,
-    struct device_attribute* attr, char* buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+    unsigned long flags;
+    unsigned int ms;
+    int err = kstrtouint(buf, 0, &ms);
+    if(err){
+        return err;
+    }
+    if(!gdev->irq){
+        return -EINVAL; // only interrupt capable inputs can count
+    }
+    if(gdev->enc){
+        return -EBUSY;
+    }
+
+    hrtimer_cancel(&gdev->gate_timer);
+
+    spin_lock_irqsave(&gdev->lock, flags);
+    gdev->gate_edges = 0;
+    gdev->count_total = 0;
+    gdev->count_edges = 0;
+    gdev->period_ns = 0;
+    WRITE_ONCE(gdev->gate_ms, ms);
+    spin_unlock_irqrestore(&gdev->lock, flags);
+
+    if(ms){
+        hrtimer_start(&gdev->gate_timer, ms_to_ktime(ms), HRTIMER_MODE_REL);
+    }
+
+    return size;
+}
 
-	int len = sprintf(buf, "%i\n", toggle_state);
+static ssize_t count_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+    unsigned long flags;
+    u64 total;
 
-	printk("Show called with %i\n", toggle_state);
+    spin_lock_irqsave(&gdev->lock, flags);
+    total = gdev->count_total;
+    spin_unlock_irqrestore(&gdev->lock, flags);
 
-	return len;
+    return sprintf(buf, "%llu\n", total);
 }
 
+/* Frequency of the last gate in milli-Hertz */
+static ssize_t frequency_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+    u64 period = READ_ONCE(gdev->period_ns);
 
+    return sprintf(buf, "%llu\n", period ? div64_u64(1000000000000ULL, period) : 0);
+}
 
-/* Assigning attribute to device */
+static ssize_t period_ns_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
 
-static struct device_attribute dev_attr_gpio_toggle_state = {
-	.attr = {
-		.name = "gpio_toggle_state",
-		.mode = 0644},	//File Access Rights (U/G/O)
-	.show = gpio_toggle_state_show,	//Attribute methods
-	.store = gpio_toggle_state_store, //Attribute methods
+    return sprintf(buf, "%llu\n", READ_ONCE(gdev->period_ns));
+}
+
+static DEVICE_ATTR_RW(gate_ms);
+static DEVICE_ATTR_RO(count);
+static DEVICE_ATTR_RO(frequency);
+static DEVICE_ATTR_RO(period_ns);
+
+static struct attribute* gpio_counter_attrs[] = {
+    &dev_attr_gate_ms.attr,
+    &dev_attr_count.attr,
+    &dev_attr_frequency.attr,
+    &dev_attr_period_ns.attr,
+    NULL,
 };
 
-static struct attribute* gpio_attrs[] = {
-	&dev_attr_gpio_toggle_state.attr,
-	NULL,
+/* Only inputs with an edge interrupt can count, encoder lines are taken */
+static umode_t gpio_counter_visible(struct kobject *kobj, struct attribute *attr, int n){
+    struct gpio_dev *gdev = dev_get_drvdata(kobj_to_dev(kobj));
+
+    return gdev && gdev->dir == 0 && gdev->irq && !gdev->enc ? attr->mode : 0;
+}
+
+static const struct attribute_group gpio_counter_group = {
+    .attrs = gpio_counter_attrs,
+    .is_visible = gpio_counter_visible,
+};
+
+/* Encoder attributes, only shown on the A line of the pair */
+
+static ssize_t position_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&gdev->enc->position));
+}
+
+/* Writing sets (typically zeroes) the position */
+static ssize_t position_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+    s64 pos;
+    int err = kstrtos64(buf, 0, &pos);
+    if(err){
+        return err;
+    }
+
+    mutex_lock(&gdev->enc->lock);
+    atomic64_set(&gdev->enc->position, pos);
+    mutex_unlock(&gdev->enc->lock);
+
+    return size;
+}
+
+static ssize_t velocity_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%lld\n", (long long)atomic64_read(&gdev->enc->velocity));
+}
+
+static ssize_t velocity_ms_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%u\n", gdev->enc->velocity_ms);
+}
+
+static ssize_t velocity_ms_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    struct gpio_encoder *enc = ((struct gpio_dev *)dev_get_drvdata(dev))->enc;
+    unsigned int ms;
+    int err = kstrtouint(buf, 0, &ms);
+    if(err){
+        return err;
+    }
+
+    hrtimer_cancel(&enc->velocity_timer);
+    enc->last_position = atomic64_read(&enc->position);
+    atomic64_set(&enc->velocity, 0);
+    WRITE_ONCE(enc->velocity_ms, ms);
+    if(ms){
+        hrtimer_start(&enc->velocity_timer, ms_to_ktime(ms), HRTIMER_MODE_REL);
+    }
+
+    return size;
+}
+
+static ssize_t encoder_errors_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", atomic_read(&gdev->enc->errors));
+}
+
+static DEVICE_ATTR_RW(position);
+static DEVICE_ATTR_RO(velocity);
+static DEVICE_ATTR_RW(velocity_ms);
+static DEVICE_ATTR_RO(encoder_errors);
+
+static struct attribute* gpio_encoder_attrs[] = {
+    &dev_attr_position.attr,
+    &dev_attr_velocity.attr,
+    &dev_attr_velocity_ms.attr,
+    &dev_attr_encoder_errors.attr,
+    NULL,
+};
+
+static umode_t gpio_encoder_visible(struct kobject *kobj, struct attribute *attr, int n){
+    struct gpio_dev *gdev = dev_get_drvdata(kobj_to_dev(kobj));
+
+    return gdev && gdev->enc && gdev->enc->a == gdev ? attr->mode : 0;
+}
+
+static const struct attribute_group gpio_encoder_group = {
+    .attrs = gpio_encoder_attrs,
+    .is_visible = gpio_encoder_visible,
+};
+
+/* PWM attributes, in pwm/ of output lines. Changes take effect at once */
+
+enum gpio_pwm_attr { GPIO_PWM_PERIOD, GPIO_PWM_DUTY, GPIO_PWM_PHASE, GPIO_PWM_ENABLE };
+
+static int gpio_pwm_set(struct gpio_dev *gdev, enum gpio_pwm_attr which, u64 val);
+
+static ssize_t gpio_pwm_store(struct device *dev, const char *buf, size_t size,
+    enum gpio_pwm_attr which){
+
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+    u64 val;
+    int err;
+
+    if(which == GPIO_PWM_ENABLE){
+        bool on;
+
+        err = kstrtobool(buf, &on);
+        val = on;
+    } else {
+        err = kstrtou64(buf, 0, &val);
+    }
+    if(err){
+        return err;
+    }
+
+    err = gpio_pwm_set(gdev, which, val);
+    return err ? err : size;
+}
+
+static ssize_t pwm_period_ns_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%llu\n", READ_ONCE(gdev->pwm_period_ns));
+}
+
+static ssize_t pwm_period_ns_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    return gpio_pwm_store(dev, buf, size, GPIO_PWM_PERIOD);
+}
+
+static ssize_t pwm_duty_ns_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%llu\n", READ_ONCE(gdev->pwm_duty_ns));
+}
+
+static ssize_t pwm_duty_ns_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    return gpio_pwm_store(dev, buf, size, GPIO_PWM_DUTY);
+}
+
+/* Offset of the rising edge from the shared time base, in ns */
+static ssize_t pwm_phase_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%llu\n", READ_ONCE(gdev->pwm_phase_ns));
+}
+
+static ssize_t pwm_phase_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    return gpio_pwm_store(dev, buf, size, GPIO_PWM_PHASE);
+}
+
+static ssize_t pwm_enable_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", !!(READ_ONCE(gdev->pd->pwm.running) & BIT(gdev->line)));
+}
+
+static ssize_t pwm_enable_store(struct device *dev, struct device_attribute *attr,
+    const char *buf, size_t size){
+
+    return gpio_pwm_store(dev, buf, size, GPIO_PWM_ENABLE);
+}
+
+/* Named by hand, the counter mode already has a period_ns attribute */
+static struct device_attribute dev_attr_pwm_period_ns =
+    __ATTR(period_ns, 0644, pwm_period_ns_show, pwm_period_ns_store);
+static struct device_attribute dev_attr_pwm_duty_ns =
+    __ATTR(duty_ns, 0644, pwm_duty_ns_show, pwm_duty_ns_store);
+static struct device_attribute dev_attr_pwm_phase =
+    __ATTR(phase, 0644, pwm_phase_show, pwm_phase_store);
+static struct device_attribute dev_attr_pwm_enable =
+    __ATTR(enable, 0644, pwm_enable_show, pwm_enable_store);
+
+static struct attribute* gpio_pwm_attrs[] = {
+    &dev_attr_pwm_period_ns.attr,
+    &dev_attr_pwm_duty_ns.attr,
+    &dev_attr_pwm_phase.attr,
+    &dev_attr_pwm_enable.attr,
+    NULL,
+};
+
+static umode_t gpio_pwm_visible(struct kobject *kobj, struct attribute *attr, int n){
+    struct gpio_dev *gdev = dev_get_drvdata(kobj_to_dev(kobj));
+
+    return gdev && gdev->dir == 1 ? attr->mode : 0;
+}
+
+static const struct attribute_group gpio_pwm_group = {
+    .name = "pwm",
+    .attrs = gpio_pwm_attrs,
+    .is_visible = gpio_pwm_visible,
 };
 
-static const struct attribute_group gpio_group = {
-	.attrs = gpio_attrs,
+/*
+ * Input attributes. value is notified on every edge (not per edge in
+ * counter mode), so a monitor can poll() it for POLLPRI and re-read it
+ * instead of sampling on a timer. edges counts every edge since probe.
+ */
+
+static ssize_t value_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+    int val = gpio_get_value_cansleep(gdev->no);
+
+    return val < 0 ? val : sprintf(buf, "%d\n", val);
+}
+
+static ssize_t edges_show(struct device *dev, struct device_attribute *attr, char *buf){
+    struct gpio_dev *gdev = dev_get_drvdata(dev);
+
+    return sprintf(buf, "%d\n", atomic_read(&gdev->events));
+}
+
+static DEVICE_ATTR_RO(value);
+static DEVICE_ATTR_RO(edges);
+
+static struct attribute* gpio_input_attrs[] = {
+    &dev_attr_value.attr,
+    &dev_attr_edges.attr,
+    NULL,
+};
+
+static umode_t gpio_input_visible(struct kobject *kobj, struct attribute *attr, int n){
+    struct gpio_dev *gdev = dev_get_drvdata(kobj_to_dev(kobj));
+
+    return gdev && gdev->dir == 0 ? attr->mode : 0;
+}
+
+static const struct attribute_group gpio_input_group = {
+    .attrs = gpio_input_attrs,
+    .is_visible = gpio_input_visible,
 };
 
 static const struct attribute_group* gpio_groups[] = {
-	&gpio_group,
+	&gpio_counter_group,
+	&gpio_input_group,
+	&gpio_encoder_group,
+	&gpio_pwm_group,
 	NULL,
 };
 
@@ -95,26 +564,21 @@ static int __init gpio_init(void){
     int err = 0;
 
     //Allocate device
-    err = alloc_chrdev_region(&devno, 0, gpios_len, "gpio_driver");
+    err = alloc_chrdev_region(&devno, 0, GPIO_MINORS, "gpio_driver");
     if(err){
         printk("Failed to register device\n");
         goto err_exit;
     }
     printk("GPIO driver assigned Major no. %i\n", MAJOR(devno));
 
-    //Tell kernel about the cdev structure - Final step
-    cdev_init(&gpio_cdev, &gpio_fops);
-    err = cdev_add(&gpio_cdev, devno, gpios_len);
-    if(err < 0){
-        goto err_dev_unregister;
-    }
+    gpio_debugfs = debugfs_create_dir("plat_drv", NULL); // optional, errors ignored
 
     gpio_class = class_create(THIS_MODULE, "gpio_class"); //Create gpio class
     if(IS_ERR(gpio_class)){
         printk("Failed to create gpio class\n");
+        err = PTR_ERR(gpio_class);
         goto err_dev_unregister;
     }
-	gpio_class->dev_groups = gpio_groups;
 
     err = platform_driver_register(&gpio_platform_driver);
     if(err){
@@ -127,7 +591,8 @@ static int __init gpio_init(void){
     err_cleanup_class:
         class_destroy(gpio_class);
     err_dev_unregister:
-        unregister_chrdev_region(devno, gpios_len); //unregister devices if error
+        unregister_chrdev_region(devno, GPIO_MINORS); //unregister devices if error
+        debugfs_remove_recursive(gpio_debugfs);
     err_exit:
         return err;
 }
@@ -137,40 +602,737 @@ static void __exit gpio_exit(void){
 
     class_destroy(gpio_class); //Destroy gpio class
 
-    cdev_del(&gpio_cdev); //Delete added cdev
+    unregister_chrdev_region(devno, GPIO_MINORS); //unregister device
+
+    debugfs_remove_recursive(gpio_debugfs);
+
+    ida_destroy(&gpio_minors);
+    ida_destroy(&gpio_ids);
+}
+
+static void gpio_stats_add(struct gpio_stats *st, enum gpio_op op, u64 ns){
+    atomic_long_inc(&st->count[op]);
+    atomic_long_inc(&st->hist[op][min_t(int, ilog2(ns | 1), GPIO_HIST_BUCKETS - 1)]);
+}
+
+static int gpio_stats_show(struct seq_file *m, void *v){
+    static const char * const names[GPIO_OP_NR] = { "open", "read", "write", "ioctl" };
+    struct gpio_stats *st = m->private;
 
-    unregister_chrdev_region(devno, gpios_len); //unregister device
+    for(int op = 0; op < GPIO_OP_NR; op++){
+        seq_printf(m, "%s %ld\n", names[op], atomic_long_read(&st->count[op]));
+        for(int b = 0; b < GPIO_HIST_BUCKETS; b++){
+            long n = atomic_long_read(&st->hist[op][b]);
+            if(n){
+                seq_printf(m, "  < %10llu ns %ld\n", 2ULL << b, n);
+            }
+        }
+    }
+    return 0;
 }
+DEFINE_SHOW_ATTRIBUTE(gpio_stats);
+
+/* Sample every line of the bank into a bitmask */
+static int gpio_bank_get(struct gpio_bank *bank, u32 *mask){
+    int n = min_t(int, bank->descs->ndescs, GPIO_BANK_MAX);
+    int err;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+    DECLARE_BITMAP(bits, GPIO_BANK_MAX);
+
+    err = gpiod_get_raw_array_value_cansleep(n, bank->descs->desc,
+                                             bank->descs->info, bits);
+    *mask = bits[0];
+#else
+    int values[GPIO_BANK_MAX];
+
+    err = gpiod_get_raw_array_value_cansleep(n, bank->descs->desc, values);
+    *mask = 0;
+    for(int i = 0; i < n; i++){
+        *mask |= (u32)!!values[i] << i;
+    }
+#endif
+    return err;
+}
+
+/* Drive the bank lines in lines from their bits in values, in one array call */
+static void gpio_bank_write_lines(struct gpio_bank *bank, unsigned long lines,
+    unsigned long values){
+
+    struct gpio_desc *desc[GPIO_BANK_MAX];
+    int n = 0, bit;
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(4, 20, 0)
+    DECLARE_BITMAP(bits, GPIO_BANK_MAX);
+
+    bits[0] = 0;
+    for_each_set_bit(bit, &lines, GPIO_BANK_MAX){
+        if(values & BIT(bit)){
+            __set_bit(n, bits);
+        }
+        desc[n++] = bank->descs->desc[bit];
+    }
+    if(bank->cansleep){
+        gpiod_set_raw_array_value_cansleep(n, desc, NULL, bits);
+    } else {
+        gpiod_set_raw_array_value(n, desc, NULL, bits); // also from the PWM timer
+    }
+#else
+    int vals[GPIO_BANK_MAX];
+
+    for_each_set_bit(bit, &lines, GPIO_BANK_MAX){
+        vals[n] = !!(values & BIT(bit));
+        desc[n++] = bank->descs->desc[bit];
+    }
+    if(bank->cansleep){
+        gpiod_set_raw_array_value_cansleep(n, desc, vals);
+    } else {
+        gpiod_set_raw_array_value(n, desc, vals); // also from the PWM timer
+    }
+#endif
+}
+
+/*
+ * PLAT_IOC_SET (mask is the new value of all outputs) or one of the *_MASK
+ * commands: one atomic op on the shadow, then the touched lines are written
+ * from it. Writers of the same line can reach the hardware out of order,
+ * so a writer that finds the shadow changed after its write writes again;
+ * the last write of a line always matches the shadow.
+ */
+static void gpio_out_flush(struct gpio_bank *bank, unsigned long lines){
+    unsigned long cur;
+
+    do{
+        cur = atomic_long_read(&bank->shadow);
+        gpio_bank_write_lines(bank, lines, cur);
+        smp_mb(); // write before re-checking the shadow
+    } while((atomic_long_read(&bank->shadow) ^ cur) & lines);
+}
+
+static void gpio_out_update(struct gpio_bank *bank, unsigned int cmd, unsigned long mask){
+    unsigned long lines = cmd == PLAT_IOC_SET ? bank->out_mask : mask & bank->out_mask;
+
+    if(!lines){
+        return;
+    }
+
+    switch(cmd){
+        case PLAT_IOC_SET:
+            atomic_long_set(&bank->shadow, mask & bank->out_mask);
+            break;
+        case PLAT_IOC_SET_MASK:
+            atomic_long_or(lines, &bank->shadow);
+            break;
+        case PLAT_IOC_CLEAR_MASK:
+            atomic_long_andnot(lines, &bank->shadow);
+            break;
+        default:
+            atomic_long_xor(lines, &bank->shadow);
+            break;
+    }
+
+    gpio_out_flush(bank, lines);
+}
+
+/* Set the shadow bits in lines to their bits in values at once, then write them */
+static void gpio_out_assign(struct gpio_bank *bank, unsigned long lines, unsigned long values){
+    long old, prev;
+
+    lines &= bank->out_mask;
+    if(!lines){
+        return;
+    }
+
+    old = atomic_long_read(&bank->shadow);
+    while((prev = atomic_long_cmpxchg(&bank->shadow, old,
+                                      (old & ~lines) | (values & lines))) != old){
+        old = prev;
+    }
+
+    gpio_out_flush(bank, lines);
+}
+
+/* Levels of the enabled lines at now, returns the ns to the nearest edge (U64_MAX: none) */
+static u64 gpio_pwm_eval(struct gpio_pdata *pd, ktime_t now, unsigned long *levels){
+    u64 t = ktime_to_ns(ktime_sub(now, pd->pwm.epoch));
+    u64 next = U64_MAX;
+    int bit;
+
+    *levels = 0;
+    for_each_set_bit(bit, &pd->pwm.running, GPIO_BANK_MAX){
+        struct gpio_dev *gdev = &pd->gpios[bit];
+        u64 period = gdev->pwm_period_ns, duty = gdev->pwm_duty_ns;
+        u64 pos;
+
+        if(duty == 0){
+            continue; // constantly low
+        }
+        if(duty >= period){
+            *levels |= BIT(bit); // constantly high
+            continue;
+        }
+
+        div64_u64_rem(t + period - gdev->pwm_phase_ns, period, &pos);
+        if(pos < duty){
+            *levels |= BIT(bit);
+            next = min(next, duty - pos);
+        } else {
+            next = min(next, period - pos);
+        }
+    }
+    return next;
+}
+
+static void gpio_pwm_work(struct work_struct *work){
+    struct gpio_pdata *pd = container_of(work, struct gpio_pdata, pwm.work);
+
+    gpio_out_assign(&pd->bank, pd->pwm.running, READ_ONCE(pd->pwm.levels));
+}
+
+/*
+ * The next expiry is an absolute edge time computed from the epoch, not
+ * from this expiry, so a late callback writes the levels that are due now
+ * and the waveform stays on its grid.
+ */
+static enum hrtimer_restart gpio_pwm_timer(struct hrtimer *timer){
+    struct gpio_pdata *pd = container_of(timer, struct gpio_pdata, pwm.timer);
+    ktime_t now = ktime_get();
+    unsigned long levels;
+    u64 next = gpio_pwm_eval(pd, now, &levels);
+
+    if(pd->bank.cansleep){
+        WRITE_ONCE(pd->pwm.levels, levels);
+        schedule_work(&pd->pwm.work);
+    } else {
+        gpio_out_assign(&pd->bank, pd->pwm.running, levels);
+    }
+
+    if(next == U64_MAX){
+        return HRTIMER_NORESTART;
+    }
+    hrtimer_set_expires(timer, ktime_add_ns(now, next));
+    return HRTIMER_RESTART;
+}
+
+static void gpio_pwm_stop(struct gpio_pwm *pwm){
+    hrtimer_cancel(&pwm->timer);
+    cancel_work_sync(&pwm->work);
+}
+
+/*
+ * Change one setting of a line. The engine is stopped meanwhile and then
+ * re-evaluates every line at once, so the timer and work never see a
+ * half done change. A disabled line is driven low.
+ */
+static int gpio_pwm_set(struct gpio_dev *gdev, enum gpio_pwm_attr which, u64 val){
+    struct gpio_pdata *pd = gdev->pd;
+    struct gpio_pwm *pwm = &pd->pwm;
+    unsigned long bit = BIT(gdev->line);
+    u64 period, duty, phase;
+    bool on;
+    int err = 0;
+
+    mutex_lock(&pwm->lock);
+
+    period = which == GPIO_PWM_PERIOD ? val : gdev->pwm_period_ns;
+    duty = which == GPIO_PWM_DUTY ? val : gdev->pwm_duty_ns;
+    phase = which == GPIO_PWM_PHASE ? val : gdev->pwm_phase_ns;
+    on = which == GPIO_PWM_ENABLE ? val : pwm->running & bit;
+
+    if(duty > period || (phase && phase >= period) ||
+       (on && period < GPIO_PWM_MIN_PERIOD_NS)){
+        err = -EINVAL;
+        goto out_unlock;
+    }
+
+    gpio_pwm_stop(pwm);
+
+    WRITE_ONCE(gdev->pwm_period_ns, period);
+    WRITE_ONCE(gdev->pwm_duty_ns, duty);
+    WRITE_ONCE(gdev->pwm_phase_ns, phase);
+    if(on && !pwm->running){
+        pwm->epoch = ktime_get();
+    }
+    if(on){
+        WRITE_ONCE(pwm->running, pwm->running | bit);
+    } else if(pwm->running & bit){
+        WRITE_ONCE(pwm->running, pwm->running & ~bit);
+        gpio_out_update(&pd->bank, PLAT_IOC_CLEAR_MASK, bit);
+    }
+
+    if(pwm->running){
+        hrtimer_start(&pwm->timer, ktime_get(), HRTIMER_MODE_ABS);
+    }
+
+    out_unlock:
+        mutex_unlock(&pwm->lock);
+        return err;
+}
+
+static void gpio_pdata_free(struct kref *ref){
+    kfree(container_of(ref, struct gpio_pdata, ref));
+}
+
+static void gpio_pdata_put(void *data){
+    struct gpio_pdata *pd = data;
+
+    kref_put(&pd->ref, gpio_pdata_free);
+}
+
+/* The node's gpio_dev or gpio_pdata with a reference on its pdata, NULL if removed */
+static void *gpio_node_get(struct inode *inode, bool bank){
+    void *node;
+
+    mutex_lock(&gpio_nodes_lock);
+    node = gpio_nodes[iminor(inode)];
+    if(node){
+        kref_get(bank ? &((struct gpio_pdata *)node)->ref : &((struct gpio_dev *)node)->pd->ref);
+    }
+    mutex_unlock(&gpio_nodes_lock);
+    return node;
+}
+
+/*
+ * Hardware access of an open file, false once the device is removed: the
+ * descriptors and IRQs are devm managed and freed after remove.
+ */
+static bool gpio_pdata_enter(struct gpio_pdata *pd){
+    down_read(&pd->gone_lock);
+    if(pd->gone){
+        up_read(&pd->gone_lock);
+        return false;
+    }
+    return true;
+}
+
+static void gpio_pdata_exit(struct gpio_pdata *pd){
+    up_read(&pd->gone_lock);
+}
+
+/* Bank read: "0x<mask>\n" of all lines, sampled at once */
+static ssize_t gpio_bank_do_read(struct file *filep, char __user *buf,
+    size_t count, loff_t *f_pos){
+
+    struct gpio_pdata *pd = filep->private_data;
+    char valbuf[16];
+    u32 mask;
+    int len, err;
+
+    err = gpio_bank_get(&pd->bank, &mask);
+    if(err < 0){
+        return err;
+    }
+
+    len = snprintf(valbuf, sizeof(valbuf), "0x%x\n", mask);
+    len = len > count ? count : len;
+    if(copy_to_user(buf, valbuf, len)){
+        return -EFAULT;
+    }
+
+    *f_pos += len;
+    return len;
+}
+
+/* Bank write: a number, bit i drives output line i */
+static ssize_t gpio_bank_do_write(struct file *filep, const char __user *ubuf,
+    size_t count, loff_t *f_pos){
+
+    struct gpio_pdata *pd = filep->private_data;
+    char write_buf[16];
+    u32 mask;
+    int err;
+
+    if(count >= sizeof(write_buf)){
+        return -EINVAL;
+    }
+    if(copy_from_user(write_buf, ubuf, count)){
+        return -EFAULT;
+    }
+    write_buf[count] = '\0';
+
+    err = kstrtou32(strim(write_buf), 0, &mask);
+    if(err){
+        return err;
+    }
+
+    gpio_out_update(&pd->bank, PLAT_IOC_SET, mask);
+
+    return count;
+}
+
+/* Binary fast path of the bank, no formatting or parsing */
+static long gpio_bank_do_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+    struct gpio_pdata *pd = filep->private_data;
+    struct plat_gpio_value v;
+    struct plat_gpio_mask m;
+    u32 cur;
+    int err = 0;
+
+    switch(cmd){
+        case PLAT_IOC_GET:
+            err = gpio_bank_get(&pd->bank, &cur);
+            if(err < 0){
+                return err;
+            }
+            v.value = cur;
+            if(copy_to_user((void __user *)arg, &v, sizeof(v))){
+                return -EFAULT;
+            }
+            return 0;
+        case PLAT_IOC_SET:
+            if(copy_from_user(&v, (void __user *)arg, sizeof(v))){
+                return -EFAULT;
+            }
+            gpio_out_update(&pd->bank, PLAT_IOC_SET, v.value);
+            return 0;
+        case PLAT_IOC_SET_MASK:
+        case PLAT_IOC_CLEAR_MASK:
+        case PLAT_IOC_TOGGLE_MASK:
+            if(copy_from_user(&m, (void __user *)arg, sizeof(m))){
+                return -EFAULT;
+            }
+            if(m.mask & ~pd->bank.out_mask){
+                return -EINVAL; // inputs or lines that do not exist
+            }
+            gpio_out_update(&pd->bank, cmd, m.mask);
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
+/* Bank entry points: the operation plus its stats */
+
+static ssize_t gpio_bank_read(struct file *filep, char __user *buf,
+    size_t count, loff_t *f_pos){
+
+    struct gpio_pdata *pd = filep->private_data;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    if(!gpio_pdata_enter(pd)){
+        return -ENODEV;
+    }
+    ret = gpio_bank_do_read(filep, buf, count, f_pos);
+    gpio_pdata_exit(pd);
+
+    gpio_stats_add(&pd->bank_stats, GPIO_OP_READ, ktime_get_ns() - start);
+    return ret;
+}
+
+static ssize_t gpio_bank_write(struct file *filep, const char __user *ubuf,
+    size_t count, loff_t *f_pos){
+
+    struct gpio_pdata *pd = filep->private_data;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+
+    if(!gpio_pdata_enter(pd)){
+        return -ENODEV;
+    }
+    ret = gpio_bank_do_write(filep, ubuf, count, f_pos);
+    gpio_pdata_exit(pd);
+
+    gpio_stats_add(&pd->bank_stats, GPIO_OP_WRITE, ktime_get_ns() - start);
+    return ret;
+}
+
+static long gpio_bank_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+    struct gpio_pdata *pd = filep->private_data;
+    u64 start = ktime_get_ns();
+    long ret;
+
+    if(!gpio_pdata_enter(pd)){
+        return -ENODEV;
+    }
+    ret = gpio_bank_do_ioctl(filep, cmd, arg);
+    gpio_pdata_exit(pd);
+
+    gpio_stats_add(&pd->bank_stats, GPIO_OP_IOCTL, ktime_get_ns() - start);
+    return ret;
+}
+
+static int gpio_bank_open(struct inode *inode, struct file *filep){
+    struct gpio_pdata *pd = gpio_node_get(inode, true);
+
+    if(!pd){
+        return -ENODEV;
+    }
+    filep->private_data = pd;
+    gpio_stats_add(&pd->bank_stats, GPIO_OP_OPEN, 0);
+    return 0;
+}
+
+static int gpio_bank_release(struct inode *inode, struct file *filep){
+    gpio_pdata_put(filep->private_data);
+    return 0;
+}
+
+static const struct file_operations gpio_bank_fops = {
+    .owner      = THIS_MODULE,
+    .open       = gpio_bank_open,
+    .release    = gpio_bank_release,
+    .read       = gpio_bank_read,
+    .write      = gpio_bank_write,
+    .unlocked_ioctl = gpio_bank_ioctl,
+};
 
 int gpio_open(struct inode *inode, struct file *filep){
-    int major, minor;
+    struct gpio_dev *gdev = gpio_node_get(inode, false);
+    struct gpio_file *gf;
+    u64 start = ktime_get_ns();
 
-    major = MAJOR(inode->i_rdev);
-    minor = MINOR(inode->i_rdev);
-    printk("Opening GPIO Device [major], [minor]: %i, %i\n", major, minor);
+    if(!gdev){
+        return -ENODEV;
+    }
+    trace_plat_drv_open(gdev->no, iminor(inode));
+
+    gf = kzalloc(sizeof(*gf), GFP_KERNEL);
+    if(!gf){
+        gpio_pdata_put(gdev->pd);
+        return -ENOMEM;
+    }
+    gf->gdev = gdev;
+    gf->seen = atomic_read(&gdev->events); //only report edges from now on
+    gf->gates_seen = atomic_read(&gdev->gates);
+    filep->private_data = gf;
 
+    gpio_stats_add(&gdev->stats, GPIO_OP_OPEN, ktime_get_ns() - start);
     return 0;
 }
 
+int gpio_fasync(int fd, struct file *filep, int on){
+    struct gpio_file *gf = filep->private_data;
+
+    return fasync_helper(fd, filep, on, &gf->gdev->async_queue);
+}
+
 int gpio_release(struct inode *inode, struct file *filep){
-    int minor, major;
+    struct gpio_file *gf = filep->private_data;
+    struct gpio_pdata *pd = gf->gdev->pd;
+
+    trace_plat_drv_release(gf->gdev->no, iminor(inode));
 
-    major = MAJOR(inode->i_rdev);
-    minor = MINOR(inode->i_rdev);
-    printk("Closing/Releasing GPIO Device [major], [minor]: %i, %i\n", major, minor);
+    gpio_fasync(-1, filep, 0); //drop SIGIO registration of this file
+    kfree(gf);
+    gpio_pdata_put(pd); // may free the line, so last
 
     return 0;
 }
 
-ssize_t gpio_read(struct file *filep, char __user *buf,
+/*
+ * Inputs are readable when the line has changed since this file last read
+ * it (in counter mode: when a new gate has completed), outputs are always
+ * writable.
+ */
+__poll_t gpio_poll(struct file *filep, poll_table *wait){
+    struct gpio_file *gf = filep->private_data;
+    struct gpio_dev *gdev = gf->gdev;
+
+    if(READ_ONCE(gdev->pd->gone)){
+        return EPOLLERR | EPOLLHUP;
+    }
+    if(gdev->dir != 0){
+        return EPOLLOUT | EPOLLWRNORM;
+    }
+
+    poll_wait(filep, &gdev->wait, wait);
+
+    if(READ_ONCE(gdev->gate_ms)){
+        return atomic_read(&gdev->gates) != gf->gates_seen ? EPOLLIN | EPOLLRDNORM : 0;
+    }
+
+    return atomic_read(&gdev->events) != gf->seen ? EPOLLIN | EPOLLRDNORM : 0;
+}
+
+/* Wake poll()ers of the value attribute, kernfs_notify() works from any context */
+static void gpio_value_notify(struct gpio_dev *gdev){
+    struct kernfs_node *kn = READ_ONCE(gdev->value_kn);
+
+    if(kn){
+        sysfs_notify_dirent(kn);
+    }
+}
+
+static irqreturn_t gpio_line_isr(int irq, void *dev_id){
+    struct gpio_dev *gdev = dev_id;
+    u64 now = ktime_get_ns();
+
+    atomic_inc(&gdev->events);
+
+    if(READ_ONCE(gdev->gate_ms)){
+        spin_lock(&gdev->lock);
+        if(gdev->gate_edges++ == 0){
+            gdev->gate_first_ts = now;
+        }
+        gdev->gate_last_ts = now;
+        gdev->count_total++;
+        spin_unlock(&gdev->lock);
+        return IRQ_HANDLED; // readers are woken by the gate timer
+    }
+
+    wake_up_interruptible(&gdev->wait);
+    kill_fasync(&gdev->async_queue, SIGIO, POLL_IN);
+    gpio_value_notify(gdev);
+
+    return IRQ_HANDLED;
+}
+
+/*
+ * End of a gate. The line interrupts on both edges, so two edges make one
+ * signal period; the period is taken between the first and last edge of
+ * the gate rather than edges/gate_ms, which keeps slow signals accurate.
+ */
+static enum hrtimer_restart gpio_gate(struct hrtimer *timer){
+    struct gpio_dev *gdev = container_of(timer, struct gpio_dev, gate_timer);
+    unsigned int gate_ms = READ_ONCE(gdev->gate_ms);
+    unsigned long flags;
+
+    if(!gate_ms){
+        return HRTIMER_NORESTART;
+    }
+
+    spin_lock_irqsave(&gdev->lock, flags);
+    gdev->count_edges = gdev->gate_edges;
+    gdev->period_ns = 0;
+    if(gdev->gate_edges >= 2){
+        gdev->period_ns = div64_u64((gdev->gate_last_ts - gdev->gate_first_ts) * 2,
+                                    gdev->gate_edges - 1);
+    }
+    gdev->gate_edges = 0;
+    spin_unlock_irqrestore(&gdev->lock, flags);
+
+    atomic_inc(&gdev->gates);
+    wake_up_interruptible(&gdev->wait);
+    kill_fasync(&gdev->async_queue, SIGIO, POLL_IN);
+
+    hrtimer_forward_now(timer, ms_to_ktime(gate_ms));
+    return HRTIMER_RESTART;
+}
+
+/*
+ * Edge on either encoder line. Threaded, as reading the lines may sleep on
+ * expanders and gpio-sim.
+ */
+static irqreturn_t gpio_encoder_thread(int irq, void *dev_id){
+    struct gpio_dev *gdev = dev_id;
+    struct gpio_encoder *enc = gdev->enc;
+    int a, b;
+    s8 delta;
+
+    mutex_lock(&enc->lock);
+    a = gpio_get_value_cansleep(enc->a->no);
+    b = gpio_get_value_cansleep(enc->b->no);
+    if(a >= 0 && b >= 0){
+        u8 state = (a << 1) | b;
+
+        delta = gpio_quad_table[(enc->state << 2) | state];
+        if(delta == 2){
+            atomic_inc(&enc->errors);
+        } else if(delta){
+            atomic64_add(delta, &enc->position);
+        }
+        enc->state = state;
+    }
+    mutex_unlock(&enc->lock);
+
+    atomic_inc(&gdev->events);
+    wake_up_interruptible(&gdev->wait);
+    kill_fasync(&gdev->async_queue, SIGIO, POLL_IN);
+    gpio_value_notify(gdev);
+
+    return IRQ_HANDLED;
+}
+
+static enum hrtimer_restart gpio_encoder_sample(struct hrtimer *timer){
+    struct gpio_encoder *enc = container_of(timer, struct gpio_encoder, velocity_timer);
+    unsigned int ms = READ_ONCE(enc->velocity_ms);
+    s64 pos = atomic64_read(&enc->position);
+
+    if(!ms){
+        return HRTIMER_NORESTART;
+    }
+
+    atomic64_set(&enc->velocity, div_s64((pos - enc->last_position) * 1000, ms));
+    enc->last_position = pos;
+
+    hrtimer_forward_now(timer, ms_to_ktime(ms));
+    return HRTIMER_RESTART;
+}
+
+/* Pair up the lines named by encoder-lines, both must be inputs */
+static void gpio_encoder_setup(struct gpio_pdata *pd, struct device_node *np){
+    struct gpio_encoder *enc = &pd->enc;
+    u32 lines[2];
+
+    if(of_property_read_u32_array(np, "encoder-lines", lines, 2)){
+        return;
+    }
+    if(lines[0] >= pd->ngpios || lines[1] >= pd->ngpios || lines[0] == lines[1] ||
+       pd->gpios[lines[0]].dir != 0 || pd->gpios[lines[1]].dir != 0){
+        printk("encoder-lines must name two different input lines\n");
+        return;
+    }
+
+    mutex_init(&enc->lock);
+    atomic64_set(&enc->position, 0);
+    atomic64_set(&enc->velocity, 0);
+    atomic_set(&enc->errors, 0);
+    enc->velocity_ms = 0;
+    hrtimer_init(&enc->velocity_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+    enc->velocity_timer.function = gpio_encoder_sample;
+
+    enc->a = &pd->gpios[lines[0]];
+    enc->b = &pd->gpios[lines[1]];
+    enc->a->enc = enc;
+    enc->b->enc = enc;
+
+    printk("Encoder on GPIO %d/%d\n", enc->a->no, enc->b->no);
+}
+
+/* Counter mode read: "<total> <gate edges> <period_ns> <freq_mHz>" of the last gate */
+static ssize_t gpio_read_count(struct gpio_dev *gdev, struct gpio_file *gf,
+    char __user *buf, size_t count, loff_t *f_pos){
+
+    char valbuf[96];
+    unsigned long flags;
+    u64 total, period;
+    u32 edges;
+    int len;
+
+    spin_lock_irqsave(&gdev->lock, flags);
+    gf->gates_seen = atomic_read(&gdev->gates);
+    total = gdev->count_total;
+    edges = gdev->count_edges;
+    period = gdev->period_ns;
+    spin_unlock_irqrestore(&gdev->lock, flags);
+
+    len = snprintf(valbuf, sizeof(valbuf), "%llu %u %llu %llu\n", total, edges, period,
+                   period ? div64_u64(1000000000000ULL, period) : 0);
+    len = len > count ? count : len;
+
+    if(copy_to_user(buf, valbuf, len)){
+        return -EFAULT;
+    }
+
+    *f_pos += len;
+    return len;
+}
+
+static ssize_t gpio_do_read(struct file *filep, char __user *buf,
     size_t count, loff_t *f_pos){
 
     int val;
     char valbuf[16];
 
-    int minor = iminor(filep->f_inode);
+    struct gpio_file *gf = filep->private_data;
+    struct gpio_dev *gdev = gf->gdev;
 
-    val = gpio_get_value(gpio_devs[minor].no);
+    if(READ_ONCE(gdev->gate_ms)){
+        return gpio_read_count(gdev, gf, buf, count, f_pos);
+    }
+
+    /* The edges up to now are consumed by this read */
+    gf->seen = atomic_read(&gdev->events);
+    val = gpio_get_value(gdev->no);
 
     sprintf(valbuf, "%d", val);
 
@@ -186,25 +1348,282 @@ ssize_t gpio_read(struct file *filep, char __user *buf,
     return valbuf_len;
 }
 
-ssize_t gpio_write(struct file *filep, const char __user *ubuf, size_t count, loff_t *f_pos){
+static ssize_t gpio_do_write(struct file *filep, const char __user *ubuf,
+    size_t count, loff_t *f_pos){
 
-    char write_buf[count];
+    struct gpio_dev *gdev = ((struct gpio_file *)filep->private_data)->gdev;
+    char write_buf[16];
     int write_val;
+    int err;
 
-    unsigned long err = copy_from_user(write_buf, ubuf, count);
-    if(err < 0){
-        printk("Error copying from user\n");
+    /* A value is a few characters, anything longer is a mistake */
+    if(count >= sizeof(write_buf)){
+        return -EINVAL;
     }
+    if(copy_from_user(write_buf, ubuf, count)){
+        return -EFAULT;
+    }
+    write_buf[count] = '\0';
 
-    sscanf(write_buf, "%d", &write_val);
-
-    int minor = iminor(filep->f_inode);
+    err = kstrtoint(strim(write_buf), 0, &write_val);
+    if(err){
+        return err;
+    }
 
-    gpio_set_value(gpio_devs[minor].no, write_val);
+    if(gdev->dir == 1){
+        gpio_out_update(&gdev->pd->bank, write_val ? PLAT_IOC_SET_MASK : PLAT_IOC_CLEAR_MASK,
+                        BIT(gdev->line));
+    } else {
+        gpio_set_value(gdev->no, write_val);
+    }
 
     return count;
 }
 
+/* Binary fast path of a single line */
+static long gpio_do_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+    struct gpio_file *gf = filep->private_data;
+    struct gpio_dev *gdev = gf->gdev;
+    struct plat_gpio_value v;
+    struct plat_gpio_mask m;
+    int val;
+
+    switch(cmd){
+        case PLAT_IOC_GET:
+            gf->seen = atomic_read(&gdev->events); // like read(), consumes edges
+            val = gpio_get_value_cansleep(gdev->no);
+            if(val < 0){
+                return val;
+            }
+            v.value = val;
+            if(copy_to_user((void __user *)arg, &v, sizeof(v))){
+                return -EFAULT;
+            }
+            return 0;
+        case PLAT_IOC_SET:
+            if(copy_from_user(&v, (void __user *)arg, sizeof(v))){
+                return -EFAULT;
+            }
+            if(gdev->dir != 1){
+                return -EPERM;
+            }
+            gpio_out_update(&gdev->pd->bank, v.value ? PLAT_IOC_SET_MASK : PLAT_IOC_CLEAR_MASK,
+                            BIT(gdev->line));
+            return 0;
+        case PLAT_IOC_SET_MASK:
+        case PLAT_IOC_CLEAR_MASK:
+        case PLAT_IOC_TOGGLE_MASK:
+            if(copy_from_user(&m, (void __user *)arg, sizeof(m))){
+                return -EFAULT;
+            }
+            if(gdev->dir != 1){
+                return -EPERM;
+            }
+            if(m.mask & 1){
+                gpio_out_update(&gdev->pd->bank, cmd, BIT(gdev->line));
+            }
+            return 0;
+        default:
+            return -ENOTTY;
+    }
+}
+
+/* Line entry points: the operation plus its tracepoint and stats */
+
+ssize_t gpio_read(struct file *filep, char __user *buf,
+    size_t count, loff_t *f_pos){
+
+    struct gpio_dev *gdev = ((struct gpio_file *)filep->private_data)->gdev;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+    u64 ns;
+
+    if(!gpio_pdata_enter(gdev->pd)){
+        return -ENODEV;
+    }
+    ret = gpio_do_read(filep, buf, count, f_pos);
+    gpio_pdata_exit(gdev->pd);
+    ns = ktime_get_ns() - start;
+
+    trace_plat_drv_read(gdev->no, ret, ns);
+    gpio_stats_add(&gdev->stats, GPIO_OP_READ, ns);
+    return ret;
+}
+
+ssize_t gpio_write(struct file *filep, const char __user *ubuf, size_t count, loff_t *f_pos){
+    struct gpio_dev *gdev = ((struct gpio_file *)filep->private_data)->gdev;
+    u64 start = ktime_get_ns();
+    ssize_t ret;
+    u64 ns;
+
+    if(!gpio_pdata_enter(gdev->pd)){
+        return -ENODEV;
+    }
+    ret = gpio_do_write(filep, ubuf, count, f_pos);
+    gpio_pdata_exit(gdev->pd);
+    ns = ktime_get_ns() - start;
+
+    trace_plat_drv_write(gdev->no, ret, ns);
+    gpio_stats_add(&gdev->stats, GPIO_OP_WRITE, ns);
+    return ret;
+}
+
+static long gpio_ioctl(struct file *filep, unsigned int cmd, unsigned long arg){
+    struct gpio_dev *gdev = ((struct gpio_file *)filep->private_data)->gdev;
+    u64 start = ktime_get_ns();
+    long ret;
+
+    if(!gpio_pdata_enter(gdev->pd)){
+        return -ENODEV;
+    }
+    ret = gpio_do_ioctl(filep, cmd, arg);
+    gpio_pdata_exit(gdev->pd);
+
+    gpio_stats_add(&gdev->stats, GPIO_OP_IOCTL, ktime_get_ns() - start);
+    return ret;
+}
+
+/* Give a line (or, for gdev == NULL, the bank) a minor, a cdev and a node */
+static int gpio_node_add(struct gpio_pdata *pd, struct gpio_dev *gdev){
+    struct cdev *cdev;
+    struct device *node;
+    int minor, err;
+
+    minor = ida_simple_get(&gpio_minors, 0, GPIO_MINORS, GFP_KERNEL);
+    if(minor < 0){
+        return minor;
+    }
+
+    cdev = cdev_alloc();
+    if(!cdev){
+        err = -ENOMEM;
+        goto err_ida;
+    }
+    cdev->ops = gdev ? &gpio_fops : &gpio_bank_fops;
+    cdev->owner = THIS_MODULE;
+
+    mutex_lock(&gpio_nodes_lock);
+    gpio_nodes[minor] = gdev ? (void *)gdev : pd;
+    mutex_unlock(&gpio_nodes_lock);
+
+    err = cdev_add(cdev, MKDEV(MAJOR(devno), minor), 1);
+    if(err){
+        kobject_put(&cdev->kobj);
+        goto err_nodes;
+    }
+
+    /* Instance 0 keeps the old names: gpio101.. and gpiobank0 */
+    if(gdev){
+        node = device_create_with_groups(gpio_class, NULL, MKDEV(MAJOR(devno), minor), gdev,
+            gpio_groups, "gpio%d", 100 * (pd->id + 1) + 1 + gdev->line);
+    } else {
+        node = device_create(gpio_class, NULL, MKDEV(MAJOR(devno), minor), pd,
+            "gpiobank%d", pd->id);
+    }
+    if(IS_ERR(node)){
+        err = PTR_ERR(node);
+        goto err_cdev;
+    }
+
+    if(gdev){
+        gdev->minor = minor;
+        gdev->cdev = cdev;
+        if(gdev->dir == 0){
+            WRITE_ONCE(gdev->value_kn, sysfs_get_dirent(node->kobj.sd, "value"));
+        }
+        gdev->debugfs = debugfs_create_file(dev_name(node), 0444, gpio_debugfs,
+            &gdev->stats, &gpio_stats_fops);
+    } else {
+        pd->bank_minor = minor;
+        pd->bank_cdev = cdev;
+        pd->bank_debugfs = debugfs_create_file(dev_name(node), 0444, gpio_debugfs,
+            &pd->bank_stats, &gpio_stats_fops);
+    }
+    return 0;
+
+    err_cdev:
+        cdev_del(cdev);
+    err_nodes:
+        mutex_lock(&gpio_nodes_lock);
+        gpio_nodes[minor] = NULL;
+        mutex_unlock(&gpio_nodes_lock);
+    err_ida:
+        ida_simple_remove(&gpio_minors, minor);
+        return err;
+}
+
+/* No new opens after this, the cdev is freed when the last open file is closed */
+static void gpio_node_del(struct cdev *cdev, int minor, struct dentry *debugfs){
+    mutex_lock(&gpio_nodes_lock);
+    gpio_nodes[minor] = NULL;
+    mutex_unlock(&gpio_nodes_lock);
+
+    debugfs_remove(debugfs);
+    device_destroy(gpio_class, MKDEV(MAJOR(devno), minor));
+    cdev_del(cdev);
+    ida_simple_remove(&gpio_minors, minor);
+}
+
+/*
+ * Undo what probe set up by hand. GPIOs and IRQs are devm managed and go
+ * after this, in reverse order of probe, followed by probe's reference on
+ * pd. Files still open on the nodes get -ENODEV from then on and keep pd
+ * until they are closed.
+ */
+static void gpio_pdata_teardown(struct gpio_pdata *pd){
+    if(pd->bank_minor >= 0){
+        gpio_node_del(pd->bank_cdev, pd->bank_minor, pd->bank_debugfs);
+    }
+
+    for(int i = 0; i < pd->ngpios; i++){
+        struct gpio_dev *gdev = &pd->gpios[i];
+
+        if(gdev->value_kn){
+            struct kernfs_node *kn = gdev->value_kn;
+
+            WRITE_ONCE(gdev->value_kn, NULL);
+            if(gdev->irq){
+                synchronize_irq(gdev->irq); // no handler still notifies kn
+            }
+            sysfs_put(kn);
+        }
+        if(gdev->minor >= 0){
+            gpio_node_del(gdev->cdev, gdev->minor, gdev->debugfs);
+        }
+        if(gdev->irq){
+            gdev->gate_ms = 0;
+            hrtimer_cancel(&gdev->gate_timer);
+        }
+    }
+
+    /* Only now, with velocity_ms gone from sysfs, nothing can re-arm the timer */
+    if(pd->enc.a){
+        pd->enc.velocity_ms = 0;
+        hrtimer_cancel(&pd->enc.velocity_timer);
+    }
+
+    /* Wait out open files inside the hardware, later ones see gone */
+    down_write(&pd->gone_lock);
+    pd->gone = true;
+    up_write(&pd->gone_lock);
+    for(int i = 0; i < pd->ngpios; i++){
+        if(pd->gpios[i].minor >= 0){
+            wake_up_interruptible(&pd->gpios[i].wait); // pollers see EPOLLHUP
+        }
+    }
+
+    gpio_pwm_stop(&pd->pwm);
+
+    ida_simple_remove(&gpio_ids, pd->id);
+}
+
+/*
+ * Probe runs asynchronously (PROBE_PREFER_ASYNCHRONOUS), so module load and
+ * boot do not wait for it. When the GPIO controller is not there yet,
+ * devm_gpiod_get_array() or the flags lookup return -EPROBE_DEFER, which is
+ * passed on quietly before anything is registered; the driver core retries
+ * once more providers have probed. The time to a ready device is logged.
+ */
 static int gpio_pdrv_probe(struct platform_device *pdev){
 
     int err = 0;
@@ -212,7 +1631,9 @@ static int gpio_pdrv_probe(struct platform_device *pdev){
     struct device *dev = &pdev->dev;
     struct device_node *np = dev->of_node;
     enum of_gpio_flags flag;
+    struct gpio_pdata *pd;
     int gpios_in_dt = 0;
+    u64 start = ktime_get_ns();
 
     /* Retrieve number of GPIOs */
     if ((gpios_in_dt = of_gpio_count(np)) < 0){
@@ -220,63 +1641,145 @@ static int gpio_pdrv_probe(struct platform_device *pdev){
         return -EINVAL;
     }
 
-    printk("Number of GPIOs in DT: %d\n", gpios_in_dt);
+    dev_dbg(dev, "Number of GPIOs in DT: %d\n", gpios_in_dt);
+    if(gpios_in_dt > GPIO_BANK_MAX){
+        printk("At most %d GPIOs per device\n", GPIO_BANK_MAX);
+        return -EINVAL;
+    }
+
+    pd = kzalloc(struct_size(pd, gpios, gpios_in_dt), GFP_KERNEL);
+    if(!pd){
+        return -ENOMEM;
+    }
+    kref_init(&pd->ref);
+    init_rwsem(&pd->gone_lock);
+
+    /* Registered first, so probe's reference is dropped after the IRQs are freed */
+    err = devm_add_action_or_reset(dev, gpio_pdata_put, pd);
+    if(err){
+        return err;
+    }
+    pd->ngpios = gpios_in_dt;
+    pd->bank_minor = -1;
+
+    mutex_init(&pd->pwm.lock);
+    hrtimer_init(&pd->pwm.timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS);
+    pd->pwm.timer.function = gpio_pwm_timer;
+    INIT_WORK(&pd->pwm.work, gpio_pwm_work);
+
+    /* Claim all lines at once, the descriptors also back the bank node */
+    pd->bank.descs = devm_gpiod_get_array(dev, NULL, GPIOD_ASIS);
+    if(IS_ERR(pd->bank.descs)){
+        return PTR_ERR(pd->bank.descs);
+    }
+    atomic_long_set(&pd->bank.shadow, 0); // outputs start low
 
     /* Loop through gpios in Device Tree */
     for(int i = 0; i < gpios_in_dt; i++){
-        gpio_devs[i].no = of_get_gpio(np, i);
-        if(gpio_devs[i].no < 0){
-            if(gpio_devs[i].no != -EPROBE_DEFER){
-                printk("Failed to parse io %d\n", gpio_devs[i].no);
+        struct gpio_dev *gdev = &pd->gpios[i];
+        int ret = of_get_gpio_flags(np, i, &flag);
+
+        if(ret < 0){
+            if(ret != -EPROBE_DEFER){
+                printk("Failed to get flags of GPIO %d: %d\n", i, ret);
             }
+            return ret;
         }
 
-        of_get_gpio_flags(np, i, &flag);
-        gpio_devs[i].dir = flag;
-        if(gpio_devs[i].dir < 0){
-            if(gpio_devs[i].dir != -EPROBE_DEFER){
-                printk("Failed to get flag for %d\n", gpio_devs[i].no);
-            }
+        gdev->pd = pd;
+        gdev->line = i;
+        gdev->minor = -1;
+        gdev->no = desc_to_gpio(pd->bank.descs->desc[i]);
+        gdev->dir = flag;
+        if(flag == 1 && gpiod_cansleep(pd->bank.descs->desc[i])){
+            pd->bank.cansleep = true; // before any node, PWM relies on it
         }
     }
-    /* Request gpio, set direction and create device for gpio */
+
+    pd->id = ida_simple_get(&gpio_ids, 0, GPIO_MAX_DEVICES, GFP_KERNEL);
+    if(pd->id < 0){
+        return pd->id;
+    }
+
+    gpio_encoder_setup(pd, np);
+
+    /* Set direction and create device for gpio */
     for(int i = 0; i < gpios_in_dt; i++){
+        struct gpio_dev *gdev = &pd->gpios[i];
 
-        err = gpio_request(gpio_devs[i].no, NULL);
-        if(err < 0){
-            goto err_exit;
-        }
+        init_waitqueue_head(&gdev->wait);
+        atomic_set(&gdev->events, 0);
+        atomic_set(&gdev->gates, 0);
+        spin_lock_init(&gdev->lock);
+        hrtimer_init(&gdev->gate_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL);
+        gdev->gate_timer.function = gpio_gate;
 
-        switch(gpio_devs[i].dir){
+        switch(gdev->dir){
             case 0:
-                gpio_direction_input(gpio_devs[i].no);
+                gpio_direction_input(gdev->no);
+
+                /* Edge interrupt drives poll/SIGIO readiness (and the decoder) */
+                if(gdev->enc){
+                    err = devm_request_threaded_irq(dev, gpio_to_irq(gdev->no), NULL,
+                        gpio_encoder_thread, IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING |
+                        IRQF_ONESHOT, "plat_drv_enc", gdev);
+                } else {
+                    err = devm_request_irq(dev, gpio_to_irq(gdev->no), gpio_line_isr,
+                        IRQF_TRIGGER_RISING | IRQF_TRIGGER_FALLING, "plat_drv", gdev);
+                }
+                if(err){
+                    printk("Failed to get irq for GPIO %d, poll will not report edges\n",
+                        gdev->no);
+                } else {
+                    gdev->irq = gpio_to_irq(gdev->no);
+                }
                 break;
             case 1:
-                gpio_direction_output(gpio_devs[i].no, 0);
+                gpio_direction_output(gdev->no, 0);
+                pd->bank.out_mask |= BIT(i);
                 break;
             default:
                 break;
         }
 
-        gpio_device_101 = device_create(gpio_class, NULL, MKDEV(MAJOR(devno), i),
-            NULL, "gpio%d", (101 + i));
+        err = gpio_node_add(pd, gdev);
+        if(err){
+            goto err_teardown;
+        }
+
+        dev_dbg(dev, "GPIO with nr %d added with dir %d\n", gdev->no, gdev->dir);
+    }
+
+    if(pd->enc.a){
+        /* Start decoding from the current state of the lines */
+        mutex_lock(&pd->enc.lock);
+        pd->enc.state = (gpio_get_value_cansleep(pd->enc.a->no) << 1) |
+                        gpio_get_value_cansleep(pd->enc.b->no);
+        mutex_unlock(&pd->enc.lock);
+    }
 
-        printk("GPIO with nr %d added with dir %d\n", gpio_devs[i].no, gpio_devs[i].dir);
+    err = gpio_node_add(pd, NULL);
+    if(err){
+        goto err_teardown;
     }
 
-    printk("New GPIO platform device: %s\n", pdev->name);
+    platform_set_drvdata(pdev, pd);
+
+    printk("New GPIO platform device: %s, %d lines, probed in %llu us\n", pdev->name,
+        gpios_in_dt, div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
+    trace_plat_drv_probe(pdev->name, gpios_in_dt, 0, div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
     return 0;
 
-    err_exit:
+    err_teardown:
+        gpio_pdata_teardown(pd);
+        trace_plat_drv_probe(pdev->name, gpios_in_dt, err,
+            div_u64(ktime_get_ns() - start, NSEC_PER_USEC));
         return err;
 }
 
 static int gpio_pdrv_remove(struct platform_device *pdev){
 
-    for(int i = 0; i < gpios_len; i++){
-        device_destroy(gpio_class, MKDEV(MAJOR(devno), i));
-        gpio_free(gpio_devs[i].no); //release claimed GPIO
-    }
+    gpio_pdata_teardown(platform_get_drvdata(pdev));
 
     printk("Removing GPIO device %s\n", pdev->name);
     return 0;
@@ -288,7 +1791,10 @@ struct file_operations gpio_fops = {
     .open       = gpio_open,
     .release    = gpio_release,
     .read       = gpio_read,
-    .write      = gpio_write
+    .write      = gpio_write,
+    .poll       = gpio_poll,
+    .fasync     = gpio_fasync,
+    .unlocked_ioctl = gpio_ioctl,
 };
 
 static const struct of_device_id of_gpio_platform_device_match[] = {
@@ -302,6 +1808,7 @@ static struct platform_driver gpio_platform_driver = {
         .name = "plat_drv",
         .of_match_table = of_gpio_platform_device_match,
         .owner = THIS_MODULE,
+        .probe_type = PROBE_PREFER_ASYNCHRONOUS,
     },
 };
 
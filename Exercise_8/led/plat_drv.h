@@ -0,0 +1,30 @@
+#ifndef PLAT_DRV_H
+#define PLAT_DRV_H
+
+#include <linux/types.h>
+#include <linux/ioctl.h>
+
+/*
+ * Binary ioctls on the plat_drv nodes, next to the text read()/write().
+ *
+ * On /dev/gpioNNN the value is the line level (0/1) and masks use bit 0.
+ * On /dev/gpiobank0 bit i is line i of the platform device. SET assigns
+ * all output lines at once and ignores the bits of input lines; the *_MASK
+ * commands fail with EINVAL if the mask has a bit that is not an output.
+ */
+struct plat_gpio_value {
+    __u32 value;
+};
+
+struct plat_gpio_mask {
+    __u32 mask;
+};
+
+#define PLAT_IOC_MAGIC 'p'
+#define PLAT_IOC_GET         _IOR(PLAT_IOC_MAGIC, 1, struct plat_gpio_value)
+#define PLAT_IOC_SET         _IOW(PLAT_IOC_MAGIC, 2, struct plat_gpio_value)
+#define PLAT_IOC_SET_MASK    _IOW(PLAT_IOC_MAGIC, 3, struct plat_gpio_mask)
+#define PLAT_IOC_CLEAR_MASK  _IOW(PLAT_IOC_MAGIC, 4, struct plat_gpio_mask)
+#define PLAT_IOC_TOGGLE_MASK _IOW(PLAT_IOC_MAGIC, 5, struct plat_gpio_mask)
+
+#endif
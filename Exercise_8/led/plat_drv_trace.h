@@ -0,0 +1,91 @@
+#undef TRACE_SYSTEM
+#define TRACE_SYSTEM plat_drv
+
+#if !defined(_PLAT_DRV_TRACE_H) || defined(TRACE_HEADER_MULTI_READ)
+#define _PLAT_DRV_TRACE_H
+
+#include <linux/tracepoint.h>
+
+/*
+ * Tracepoints of plat_drv, off unless enabled, e.g.
+ *   echo 1 > /sys/kernel/debug/tracing/events/plat_drv/enable
+ *   cat /sys/kernel/debug/tracing/trace_pipe
+ */
+
+DECLARE_EVENT_CLASS(plat_drv_file,
+    TP_PROTO(int gpio, int minor),
+    TP_ARGS(gpio, minor),
+    TP_STRUCT__entry(
+        __field(int, gpio)
+        __field(int, minor)
+    ),
+    TP_fast_assign(
+        __entry->gpio = gpio;
+        __entry->minor = minor;
+    ),
+    TP_printk("gpio=%d minor=%d", __entry->gpio, __entry->minor)
+);
+
+DEFINE_EVENT(plat_drv_file, plat_drv_open,
+    TP_PROTO(int gpio, int minor),
+    TP_ARGS(gpio, minor)
+);
+
+DEFINE_EVENT(plat_drv_file, plat_drv_release,
+    TP_PROTO(int gpio, int minor),
+    TP_ARGS(gpio, minor)
+);
+
+/* ret is the read()/write() return value, ns the time spent in the driver */
+DECLARE_EVENT_CLASS(plat_drv_io,
+    TP_PROTO(int gpio, long ret, u64 ns),
+    TP_ARGS(gpio, ret, ns),
+    TP_STRUCT__entry(
+        __field(int, gpio)
+        __field(long, ret)
+        __field(u64, ns)
+    ),
+    TP_fast_assign(
+        __entry->gpio = gpio;
+        __entry->ret = ret;
+        __entry->ns = ns;
+    ),
+    TP_printk("gpio=%d ret=%ld ns=%llu", __entry->gpio, __entry->ret, __entry->ns)
+);
+
+DEFINE_EVENT(plat_drv_io, plat_drv_read,
+    TP_PROTO(int gpio, long ret, u64 ns),
+    TP_ARGS(gpio, ret, ns)
+);
+
+DEFINE_EVENT(plat_drv_io, plat_drv_write,
+    TP_PROTO(int gpio, long ret, u64 ns),
+    TP_ARGS(gpio, ret, ns)
+);
+
+TRACE_EVENT(plat_drv_probe,
+    TP_PROTO(const char *name, int ngpios, int err, u64 us),
+    TP_ARGS(name, ngpios, err, us),
+    TP_STRUCT__entry(
+        __string(name, name)
+        __field(int, ngpios)
+        __field(int, err)
+        __field(u64, us)
+    ),
+    TP_fast_assign(
+        __assign_str(name, name);
+        __entry->ngpios = ngpios;
+        __entry->err = err;
+        __entry->us = us;
+    ),
+    TP_printk("%s gpios=%d err=%d us=%llu", __get_str(name), __entry->ngpios,
+              __entry->err, __entry->us)
+);
+
+#endif
+
+#undef TRACE_INCLUDE_PATH
+#define TRACE_INCLUDE_PATH .
+#undef TRACE_INCLUDE_FILE
+#define TRACE_INCLUDE_FILE plat_drv_trace
+#include <trace/define_trace.h>
@@ -0,0 +1,232 @@
+#define _GNU_SOURCE
+#include <errno.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <stdint.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <sched.h>
+#include <sys/ioctl.h>
+#include <poll.h>
+
+#include "plat_drv.h"
+
+/*
+ * Concurrent writers on one plat_drv bank.
+ *
+ *   plat_stress [-t max_threads] [-i ops_per_thread] [-b first_bit] [-u device]
+ *
+ * Runs 1, 2, ... max_threads writers, each pinned to its own core and owning
+ * one output bit (first_bit + thread). A writer alternates SET_MASK and
+ * CLEAR_MASK on its bit through /dev/gpiobank0 without any userspace lock,
+ * and checks its bit with GET now and then after a CLEAR. Throughput per
+ * writer count shows how the driver scales; a bit found in the wrong state
+ * means another writer clobbered it.
+ *
+ * Every writer's bit must be an output line of the bank, the driver fails
+ * the mask ioctls with EINVAL otherwise and the tool refuses to start. The
+ * defaults (bits 1-4) assume a gpio-sim chip with line 0 an input and lines
+ * 1-4 outputs, i.e. a "gpio-simulator" node with 5 lines in the overlay and
+ *   gpios = <&sim 0 0>, <&sim 1 1>, <&sim 2 1>, <&sim 3 1>, <&sim 4 1>;
+ * The shipped overlay has a single output (bit 1): use -t 1 there.
+ *
+ * With -u the platform device (its name in /sys/bus/platform/devices, e.g.
+ * plat_drv@0) is then unbound while /dev/gpio101 and the bank are held
+ * open. The open files must fail with ENODEV and poll must report a hang
+ * up, closing them must not crash the kernel, and after the rebind the
+ * nodes must open again.
+ */
+
+#define MAX_THREADS 4
+#define DEFAULT_OPS 100000
+#define DRIVER_DIR "/sys/bus/platform/drivers/plat_drv/"
+
+struct writer {
+  pthread_t thread;
+  int cpu;
+  uint32_t bit;
+  long ops;
+  long clobbered;
+};
+
+static int bank;
+static long ops_per_thread = DEFAULT_OPS;
+
+static double now(void){
+  struct timespec ts;
+  clock_gettime(CLOCK_MONOTONIC, &ts);
+  return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void *writer_run(void *arg){
+  struct writer *w = arg;
+  struct plat_gpio_mask m = { .mask = w->bit };
+  struct plat_gpio_value v;
+  cpu_set_t set;
+
+  CPU_ZERO(&set);
+  CPU_SET(w->cpu, &set);
+  pthread_setaffinity_np(pthread_self(), sizeof(set), &set);
+
+  for(long i = 0; i < ops_per_thread; i += 2){
+    ioctl(bank, PLAT_IOC_SET_MASK, &m);
+    ioctl(bank, PLAT_IOC_CLEAR_MASK, &m);
+    w->ops += 2;
+
+    /* Check now and then, GET itself costs a hardware read */
+    if((i & 1023) == 0 && ioctl(bank, PLAT_IOC_GET, &v) == 0 && (v.value & w->bit)){
+      w->clobbered++;
+    }
+  }
+  return NULL;
+}
+
+static int sysfs_write(const char *path, const char *val){
+  int fd = open(path, O_WRONLY);
+  int ret = -1;
+
+  if(fd >= 0){
+    ret = write(fd, val, strlen(val)) < 0 ? -1 : 0;
+    close(fd);
+  }
+  if(ret < 0){
+    printf("Error writing %s to %s: %s \n", val, path, strerror(errno));
+  }
+  return ret;
+}
+
+/* Hold a line and the bank open across an unbind, then close them */
+static int unbind_step(const char *device){
+  struct plat_gpio_value v;
+  struct pollfd pfd;
+  char buf[16];
+  int failed = 0;
+
+  int line = open("/dev/gpio101", O_RDWR);
+  int held = open("/dev/gpiobank0", O_RDWR);
+  if(line < 0 || held < 0){
+    printf("Error opening the nodes: %s \n", strerror(errno));
+    return -1;
+  }
+
+  if(sysfs_write(DRIVER_DIR "unbind", device) < 0){
+    return -1;
+  }
+
+  if(read(line, buf, sizeof(buf)) >= 0 || errno != ENODEV){
+    printf("unbind: read of an open line did not fail with ENODEV\n");
+    failed = 1;
+  }
+  if(ioctl(held, PLAT_IOC_GET, &v) == 0 || errno != ENODEV){
+    printf("unbind: GET on the open bank did not fail with ENODEV\n");
+    failed = 1;
+  }
+  pfd = (struct pollfd){ .fd = line, .events = POLLIN };
+  if(poll(&pfd, 1, 0) != 1 || !(pfd.revents & POLLHUP)){
+    printf("unbind: poll of an open line did not report POLLHUP\n");
+    failed = 1;
+  }
+
+  /* Drops the last references, the driver frees the device here */
+  close(line);
+  close(held);
+
+  if(sysfs_write(DRIVER_DIR "bind", device) < 0){
+    return -1;
+  }
+  usleep(100000); // probe is asynchronous
+  line = open("/dev/gpio101", O_RDWR);
+  if(line < 0){
+    printf("rebind: /dev/gpio101 not back: %s \n", strerror(errno));
+    return -1;
+  }
+  close(line);
+
+  printf("unbind with open files: %s\n", failed ? "FAILED" : "ok");
+  return failed;
+}
+
+int main(int argc, char *argv[]){
+  struct writer writers[MAX_THREADS];
+  int max_threads = MAX_THREADS;
+  int first_bit = 1;
+  const char *device = NULL;
+  int opt;
+
+  while((opt = getopt(argc, argv, "t:i:b:u:")) != -1){
+    switch(opt){
+      case 't':
+        max_threads = atoi(optarg);
+        break;
+      case 'i':
+        ops_per_thread = atol(optarg);
+        break;
+      case 'b':
+        first_bit = atoi(optarg);
+        break;
+      case 'u':
+        device = optarg;
+        break;
+      default:
+        printf("Usage: %s [-t max_threads] [-i ops_per_thread] [-b first_bit] [-u device]\n",
+               argv[0]);
+        return -1;
+    }
+  }
+  if(max_threads < 1 || max_threads > MAX_THREADS || first_bit + max_threads > 32){
+    printf("1 to %d threads, bits below 32\n", MAX_THREADS);
+    return -1;
+  }
+
+  bank = open("/dev/gpiobank0", O_RDWR);
+  if(bank < 0){
+    printf("Error opening /dev/gpiobank0: %s \n", strerror(errno));
+    return -1;
+  }
+
+  /* The writers' bits must be outputs, or the test measures nothing */
+  for(int t = 0; t < max_threads; t++){
+    struct plat_gpio_mask m = { .mask = 1u << (first_bit + t) };
+    if(ioctl(bank, PLAT_IOC_CLEAR_MASK, &m) < 0){
+      printf("Bit %d is not an output of /dev/gpiobank0: %s \n", first_bit + t, strerror(errno));
+      return -1;
+    }
+  }
+
+  long ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+  double base = 0;
+  int failed = 0;
+
+  for(int n = 1; n <= max_threads; n++){
+    double start = now();
+    for(int t = 0; t < n; t++){
+      writers[t] = (struct writer){ .cpu = t % ncpu, .bit = 1u << (first_bit + t) };
+      pthread_create(&writers[t].thread, NULL, writer_run, &writers[t]);
+    }
+
+    long ops = 0, clobbered = 0;
+    for(int t = 0; t < n; t++){
+      pthread_join(writers[t].thread, NULL);
+      ops += writers[t].ops;
+      clobbered += writers[t].clobbered;
+    }
+    double rate = ops / (now() - start);
+    if(n == 1){
+      base = rate;
+    }
+
+    printf("%d writer%s: %.0f ops/s (%.2fx), %ld clobbered bits\n",
+           n, n == 1 ? " " : "s", rate, rate / base, clobbered);
+    failed |= clobbered != 0;
+  }
+
+  close(bank);
+
+  if(device && unbind_step(device)){
+    failed = 1;
+  }
+  return failed;
+}